@@ -0,0 +1,155 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "analysis.h"
+
+#include <stdlib.h>
+
+#define SIMDE_ENABLE_NATIVE_ALIASES
+#include <simde/x86/sse2.h>
+
+analysis_t *analysis_create(uint32_t width, uint32_t height)
+{
+	analysis_t *analysis = calloc(1, sizeof(analysis_t));
+
+	analysis->width = width;
+	analysis->height = height;
+	analysis->thumbnail_size = analysis_thumbnail_size(width, height);
+	analysis->thumbnail = calloc(analysis->thumbnail_size, sizeof(uint16_t));
+	analysis->prev_thumbnail = calloc(analysis->thumbnail_size, sizeof(uint16_t));
+
+	return analysis;
+}
+
+void analysis_destroy(analysis_t *analysis)
+{
+	free(analysis->thumbnail);
+	free(analysis->prev_thumbnail);
+	free(analysis);
+}
+
+void analysis_frame(analysis_t *analysis, const uint8_t *luma, uint32_t linesize, double *temporal, double *spatial)
+{
+	analysis_luma_thumbnail(analysis->thumbnail, luma, linesize, analysis->width, analysis->height);
+
+	*temporal = 0.0;
+	*spatial = 0.0;
+
+	if (analysis->has_thumbnail && analysis->thumbnail_size) {
+		uint64_t sum = analysis_thumbnail_difference(analysis->thumbnail, analysis->prev_thumbnail,
+							     analysis->thumbnail_size);
+		*temporal = sum / (analysis->thumbnail_size * 8.0);
+	}
+
+	if (analysis->thumbnail_size > 1) {
+		uint64_t sum = analysis_thumbnail_difference(analysis->thumbnail, analysis->thumbnail + 1,
+							     analysis->thumbnail_size - 1);
+		*spatial = sum / ((analysis->thumbnail_size - 1) * 8.0);
+	}
+
+	uint16_t *tmp = analysis->prev_thumbnail;
+	analysis->prev_thumbnail = analysis->thumbnail;
+	analysis->thumbnail = tmp;
+	analysis->has_thumbnail = true;
+}
+
+bool analysis_is_scene_cut(double temporal, double threshold, int64_t frames_since_keyframe, int64_t min_frames)
+{
+	return temporal > threshold && frames_since_keyframe >= min_frames;
+}
+
+size_t analysis_thumbnail_size(uint32_t width, uint32_t height)
+{
+	return (height + ANALYSIS_ROW_STEP - 1) / ANALYSIS_ROW_STEP * (width / 16) * 2;
+}
+
+void analysis_luma_thumbnail(uint16_t *thumbnail, const uint8_t *luma, uint32_t linesize, uint32_t width,
+			     uint32_t height)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (uint32_t y = 0; y < height; y += ANALYSIS_ROW_STEP) {
+		const uint8_t *row = luma + (size_t)y * linesize;
+
+		for (uint32_t x = 0; x + 16 <= width; x += 16) {
+			__m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + x)), zero);
+
+			*thumbnail++ = _mm_extract_epi16(sad, 0);
+			*thumbnail++ = _mm_extract_epi16(sad, 4);
+		}
+	}
+}
+
+uint64_t analysis_thumbnail_difference(const uint16_t *a, const uint16_t *b, size_t size)
+{
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i acc = _mm_setzero_si128();
+	uint64_t sum = 0;
+	size_t i = 0;
+
+	// Sums fit 11 bits, so the per lane accumulators can't overflow
+	// for anything up to 8K.
+	for (; i + 8 <= size; i += 8) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i diff = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, ones));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	for (; i < size; i++) {
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	}
+
+	return sum;
+}
+
+void analysis_luma_thumbnail_c(uint16_t *thumbnail, const uint8_t *luma, uint32_t linesize, uint32_t width,
+			       uint32_t height)
+{
+	for (uint32_t y = 0; y < height; y += ANALYSIS_ROW_STEP) {
+		const uint8_t *row = luma + (size_t)y * linesize;
+
+		for (uint32_t x = 0; x + 8 <= width - width % 16; x += 8) {
+			uint16_t sum = 0;
+
+			for (uint32_t i = 0; i < 8; i++) {
+				sum += row[x + i];
+			}
+
+			*thumbnail++ = sum;
+		}
+	}
+}
+
+uint64_t analysis_thumbnail_difference_c(const uint16_t *a, const uint16_t *b, size_t size)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < size; i++) {
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	}
+
+	return sum;
+}
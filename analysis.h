@@ -0,0 +1,62 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Cheap luma statistics for scene-cut detection and the lookahead. Frames
+// are reduced to sums of 8 horizontal pixels on every ANALYSIS_ROW_STEP-th
+// row. No GStreamer or OBS in here, so it can be benchmarked on its own.
+
+#define ANALYSIS_ROW_STEP 4
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	size_t thumbnail_size;
+	uint16_t *thumbnail;
+	uint16_t *prev_thumbnail;
+	bool has_thumbnail;
+} analysis_t;
+
+analysis_t *analysis_create(uint32_t width, uint32_t height);
+void analysis_destroy(analysis_t *analysis);
+
+// Mean absolute luma difference per pixel to the previous frame and
+// between horizontally neighboring pixels
+void analysis_frame(analysis_t *analysis, const uint8_t *luma, uint32_t linesize, double *temporal, double *spatial);
+
+// A frame that differs by more than threshold from the previous one, at
+// least min_frames after the last keyframe
+bool analysis_is_scene_cut(double temporal, double threshold, int64_t frames_since_keyframe, int64_t min_frames);
+
+size_t analysis_thumbnail_size(uint32_t width, uint32_t height);
+
+void analysis_luma_thumbnail(uint16_t *thumbnail, const uint8_t *luma, uint32_t linesize, uint32_t width,
+			     uint32_t height);
+uint64_t analysis_thumbnail_difference(const uint16_t *a, const uint16_t *b, size_t size);
+
+// Plain C versions of the above, for comparison
+void analysis_luma_thumbnail_c(uint16_t *thumbnail, const uint8_t *luma, uint32_t linesize, uint32_t width,
+			       uint32_t height);
+uint64_t analysis_thumbnail_difference_c(const uint16_t *a, const uint16_t *b, size_t size);
@@ -0,0 +1,131 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Per frame cost of the scene-cut/lookahead analysis, SIMD against plain C.
+// Run with `meson test --benchmark`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "analysis.h"
+
+#define RUNS 200
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint8_t *make_luma(uint32_t linesize, uint32_t height, uint32_t seed)
+{
+	uint8_t *luma = malloc((size_t)linesize * height);
+
+	for (size_t i = 0; i < (size_t)linesize * height; i++) {
+		seed = seed * 1664525 + 1013904223;
+		luma[i] = seed >> 24;
+	}
+
+	return luma;
+}
+
+static int bench(const char *name, uint32_t width, uint32_t height)
+{
+	// OBS aligns lines, have the stride differ from the width
+	uint32_t linesize = (width + 63) & ~63u;
+	uint8_t *frames[2] = {make_luma(linesize, height, 1), make_luma(linesize, height, 2)};
+
+	size_t size = analysis_thumbnail_size(width, height);
+	uint16_t *a = malloc(size * sizeof(uint16_t));
+	uint16_t *b = malloc(size * sizeof(uint16_t));
+	uint16_t *c = malloc(size * sizeof(uint16_t));
+
+	double start = now();
+	for (int i = 0; i < RUNS; i++) {
+		analysis_luma_thumbnail(a, frames[i & 1], linesize, width, height);
+	}
+	double thumbnail = (now() - start) / RUNS;
+
+	start = now();
+	for (int i = 0; i < RUNS; i++) {
+		analysis_luma_thumbnail_c(c, frames[i & 1], linesize, width, height);
+	}
+	double thumbnail_c = (now() - start) / RUNS;
+
+	analysis_luma_thumbnail(b, frames[0], linesize, width, height);
+
+	uint64_t sum = 0;
+	start = now();
+	for (int i = 0; i < RUNS; i++) {
+		sum += analysis_thumbnail_difference(a, b, size);
+	}
+	double difference = (now() - start) / RUNS;
+
+	uint64_t sum_c = 0;
+	start = now();
+	for (int i = 0; i < RUNS; i++) {
+		sum_c += analysis_thumbnail_difference_c(a, b, size);
+	}
+	double difference_c = (now() - start) / RUNS;
+
+	analysis_t *analysis = analysis_create(width, height);
+	double temporal, spatial;
+
+	start = now();
+	for (int i = 0; i < RUNS; i++) {
+		analysis_frame(analysis, frames[i & 1], linesize, &temporal, &spatial);
+	}
+	double frame = (now() - start) / RUNS;
+
+	analysis_destroy(analysis);
+
+	int ret = 0;
+
+	if (memcmp(a, c, size * sizeof(uint16_t)) != 0 || sum != sum_c) {
+		fprintf(stderr, "%s: SIMD and plain C results differ\n", name);
+		ret = 1;
+	}
+
+	printf("%s: thumbnail %.3f ms (C %.3f ms), difference %.3f ms (C %.3f ms), per frame %.3f ms\n", name,
+	       thumbnail, thumbnail_c, difference, difference_c, frame);
+
+	free(a);
+	free(b);
+	free(c);
+	free(frames[0]);
+	free(frames[1]);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= bench("1080p", 1920, 1080);
+	ret |= bench("1440p", 2560, 1440);
+	ret |= bench("4K", 3840, 2160);
+
+	return ret;
+}
@@ -0,0 +1,44 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "drop.h"
+
+void drop_add_encode_time(drop_t *drop, gdouble encode_time)
+{
+	drop->encode_time = drop->encode_time == 0.0 ? encode_time : drop->encode_time * 0.9 + encode_time * 0.1;
+}
+
+bool drop_next_frame(drop_t *drop, bool keyframe)
+{
+	// Accumulating fractions spreads the drops evenly
+	if (drop->encode_time > drop->frame_duration) {
+		drop->accumulator += MIN(1.0 - drop->frame_duration / drop->encode_time, 0.5);
+	} else {
+		drop->accumulator = 0.0;
+	}
+
+	if (drop->accumulator < 1.0 || keyframe) {
+		return false;
+	}
+
+	drop->accumulator = MAX(drop->accumulator - 1.0, 0.0);
+
+	return true;
+}
@@ -0,0 +1,39 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Overload policy: drops frames at the rate that lets the encoder keep up
+// with the frame rate. Shared by the plugin and obs-vaapi-replay.
+
+typedef struct {
+	gdouble frame_duration; // Microseconds
+	gdouble encode_time;    // Average time the encoder takes per frame
+	gdouble accumulator;
+} drop_t;
+
+void drop_add_encode_time(drop_t *drop, gdouble encode_time);
+
+// Whether to drop the next frame. Never drops the one that is going to be
+// a keyframe.
+bool drop_next_frame(drop_t *drop, bool keyframe);
@@ -0,0 +1,463 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Evaluates the lookahead offline. Encodes the same frames at a range of
+// base QPs once with a fixed QP and once with the lookahead adjusting it,
+// and compares luma PSNR at equal bitrate. On x264enc the QP follows the
+// complexity through CRF changes, which evaluates the model. On a VA
+// encoder it goes through the same region of interest meta as in the
+// plugin. Keyframes are counted in both runs, so that also shows whether
+// the encoder restarts the sequence on changes, and equal results mean
+// the driver ignores the meta.
+
+#include <gst/app/app.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "analysis.h"
+#include "lookahead.h"
+#include "measure.h"
+#include "pipeline.h"
+#include "trace.h"
+
+typedef struct {
+	const gchar *encoder;
+	const gchar *codec;
+	GstCaps *caps;
+	GstVideoInfo info;
+	GPtrArray *frames;
+	gdouble *complexity;
+} eval_t;
+
+typedef struct {
+	guint qp;
+	bool failed;
+	gdouble bitrate;
+	gdouble psnr;
+	guint keyframes;
+	guint qp_changes;
+} result_t;
+
+typedef struct {
+	GMutex mutex;
+	guint64 bytes;
+	guint keyframes;
+	GPtrArray *packets;
+	GstCaps *caps;
+} run_t;
+
+static gchar *encoder_name = "x264enc";
+static gchar *trace_path = NULL;
+static gchar *pattern = "ball,snow,smpte,ball";
+static gint width = 640;
+static gint height = 360;
+static gint num_frames = 60;
+static gint lookahead_frames = 20;
+static gchar *qps = "20,26,32,38";
+
+static GOptionEntry entries[] = {
+	{"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name, "Encoder element (x264enc)", "NAME"},
+	{"trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path, "Use the frames of a trace instead of synthetic ones",
+	 "FILE"},
+	{"pattern", 'p', 0, G_OPTION_ARG_STRING, &pattern,
+	 "videotestsrc patterns for synthetic frames, comma separated (ball,snow,smpte,ball)", "PATTERN"},
+	{"width", 0, 0, G_OPTION_ARG_INT, &width, "Width of synthetic frames (640)", "W"},
+	{"height", 0, 0, G_OPTION_ARG_INT, &height, "Height of synthetic frames (360)", "H"},
+	{"frames", 'n', 0, G_OPTION_ARG_INT, &num_frames, "Number of synthetic frames per pattern (60)", "N"},
+	{"lookahead", 'l', 0, G_OPTION_ARG_INT, &lookahead_frames, "Lookahead in frames (20)", "N"},
+	{"qp", 'q', 0, G_OPTION_ARG_STRING, &qps, "Base QPs, comma separated (20,26,32,38)", "QPS"},
+	{NULL},
+};
+
+static bool load_trace_frames(eval_t *eval, trace_t *trace)
+{
+	eval->caps = pipeline_get_trace_caps(trace->header);
+
+	for (guint64 i = 0; i < trace_get_frame_count(trace); i++) {
+		const trace_frame_t *frame;
+		GstBuffer *buffer = pipeline_wrap_trace_frame(trace, i, NULL, NULL, &frame);
+
+		if (buffer != NULL) {
+			g_ptr_array_add(eval->frames, buffer);
+		}
+	}
+
+	return eval->frames->len > 0;
+}
+
+// The complexity the plugin would see for every frame
+static bool analyze_frames(eval_t *eval)
+{
+	switch (GST_VIDEO_INFO_FORMAT(&eval->info)) {
+	case GST_VIDEO_FORMAT_I420:
+	case GST_VIDEO_FORMAT_NV12:
+	case GST_VIDEO_FORMAT_Y444:
+		break;
+	default:
+		g_printerr("the lookahead needs 8-bit YUV\n");
+		return false;
+	}
+
+	analysis_t *analysis = analysis_create(GST_VIDEO_INFO_WIDTH(&eval->info), GST_VIDEO_INFO_HEIGHT(&eval->info));
+
+	eval->complexity = g_new0(gdouble, eval->frames->len);
+
+	for (guint i = 0; i < eval->frames->len; i++) {
+		GstVideoFrame frame;
+		gdouble temporal;
+		gdouble spatial;
+
+		if (!gst_video_frame_map(&frame, &eval->info, g_ptr_array_index(eval->frames, i), GST_MAP_READ)) {
+			continue;
+		}
+
+		analysis_frame(analysis, GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+			       &temporal, &spatial);
+		eval->complexity[i] = temporal + spatial;
+
+		gst_video_frame_unmap(&frame);
+	}
+
+	analysis_destroy(analysis);
+
+	return true;
+}
+
+static GstFlowReturn new_sample(GstAppSink *appsink, gpointer user_data)
+{
+	run_t *run = user_data;
+	GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+	if (sample == NULL) {
+		return GST_FLOW_ERROR;
+	}
+
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+
+	g_mutex_lock(&run->mutex);
+
+	run->bytes += gst_buffer_get_size(buffer);
+	if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+		run->keyframes++;
+	}
+	g_ptr_array_add(run->packets, gst_buffer_ref(buffer));
+
+	if (run->caps == NULL) {
+		run->caps = gst_caps_ref(gst_sample_get_caps(sample));
+	}
+
+	g_mutex_unlock(&run->mutex);
+
+	gst_sample_unref(sample);
+
+	return GST_FLOW_OK;
+}
+
+static void run_qp(eval_t *eval, guint qp, bool adaptive, result_t *result)
+{
+	GstElement *pipe = gst_pipeline_new(NULL);
+	GstElement *appsrc = gst_element_factory_make("appsrc", NULL);
+	GstElement *encoder = gst_element_factory_make(eval->encoder, NULL);
+	GstElement *appsink = gst_element_factory_make("appsink", NULL);
+	lookahead_t lookahead;
+
+	result->qp = qp;
+
+	lookahead_set_constant_qp(encoder, qp);
+	lookahead_setup(&lookahead, encoder);
+
+	// At most one frame queued, so QP changes land on their frame like in
+	// the plugin, which waits for every frame to be consumed
+	g_object_set(appsrc, "caps", eval->caps, "block", TRUE, "max-bytes", (guint64)GST_VIDEO_INFO_SIZE(&eval->info),
+		     NULL);
+	gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+	GstCaps *caps = pipeline_get_packet_caps(eval->codec);
+	g_object_set(appsink, "caps", caps, "sync", FALSE, NULL);
+	gst_caps_unref(caps);
+
+	run_t run = {0};
+	g_mutex_init(&run.mutex);
+	run.packets = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+
+	GstAppSinkCallbacks callbacks = {.new_sample = new_sample};
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, &run, NULL);
+
+	pipeline_builder_t builder = {0};
+	gchar *graph = NULL;
+	GError *err = NULL;
+
+	pipeline_builder_add(&builder, appsrc, "frames");
+	pipeline_builder_add_encoder(&builder, eval->caps, encoder, eval->codec, "auto", "hq");
+	pipeline_builder_add(&builder, appsink, "packets");
+
+	if (!pipeline_builder_build(&builder, GST_BIN(pipe), &graph, &err)) {
+		g_printerr("  %s: %s\n", err->message, graph);
+		g_error_free(err);
+	}
+	g_free(graph);
+
+	GstBus *bus = gst_element_get_bus(pipe);
+
+	gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+	// Same window as the plugin: the frame to encode and the ones behind it
+	guint count = eval->frames->len;
+	guint queued = 0;
+
+	for (guint next = 0; next < count; next++) {
+		for (; queued < count && queued - next <= (guint)lookahead_frames; queued++) {
+			lookahead_add(&lookahead, eval->complexity[queued]);
+		}
+
+		if (adaptive) {
+			gdouble complexity = 0.0;
+			for (guint i = next; i < queued; i++) {
+				complexity += eval->complexity[i];
+			}
+
+			if (lookahead_update(&lookahead, encoder, complexity / (queued - next))) {
+				result->qp_changes++;
+			}
+		}
+
+		GstBuffer *buffer = gst_buffer_copy(g_ptr_array_index(eval->frames, next));
+
+		GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(next, GST_SECOND * GST_VIDEO_INFO_FPS_D(&eval->info),
+							       GST_VIDEO_INFO_FPS_N(&eval->info));
+		GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+
+		if (adaptive) {
+			lookahead_apply(&lookahead, buffer, GST_VIDEO_INFO_WIDTH(&eval->info),
+					GST_VIDEO_INFO_HEIGHT(&eval->info));
+		}
+
+		if (gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer) != GST_FLOW_OK) {
+			break;
+		}
+	}
+	gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+	bool error = measure_pop_error(bus, 60 * GST_SECOND, GST_MESSAGE_EOS);
+	gst_object_unref(bus);
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(pipe);
+
+	result->failed = error || run.packets->len == 0;
+
+	if (!result->failed) {
+		gdouble duration = (gdouble)count * GST_VIDEO_INFO_FPS_D(&eval->info) / GST_VIDEO_INFO_FPS_N(&eval->info);
+
+		result->bitrate = run.bytes * 8 / duration / 1000.0;
+		result->psnr = measure_psnr(eval->frames, &eval->info, run.packets, run.caps);
+		result->keyframes = run.keyframes;
+	}
+
+	g_ptr_array_free(run.packets, TRUE);
+	if (run.caps) {
+		gst_caps_unref(run.caps);
+	}
+	g_mutex_clear(&run.mutex);
+}
+
+static int compare_bitrate(const void *a, const void *b)
+{
+	const result_t *ra = a;
+	const result_t *rb = b;
+
+	return (ra->bitrate > rb->bitrate) - (ra->bitrate < rb->bitrate);
+}
+
+// PSNR at log bitrate, linear between the points sorted by bitrate
+static gdouble interpolate(const result_t *results, guint count, gdouble rate)
+{
+	for (guint i = 1; i < count; i++) {
+		gdouble r0 = log(results[i - 1].bitrate);
+		gdouble r1 = log(results[i].bitrate);
+
+		if (rate <= r1 || i == count - 1) {
+			gdouble t = r1 > r0 ? (rate - r0) / (r1 - r0) : 0.0;
+			return results[i - 1].psnr + t * (results[i].psnr - results[i - 1].psnr);
+		}
+	}
+
+	return results[0].psnr;
+}
+
+// Mean PSNR difference of b over a at equal bitrate, over the bitrate range
+// both curves cover. Like the Bjøntegaard delta, but piecewise linear.
+static bool psnr_gain(result_t *a, result_t *b, guint count, gdouble *gain)
+{
+	if (count < 2) {
+		return false;
+	}
+
+	qsort(a, count, sizeof(result_t), compare_bitrate);
+	qsort(b, count, sizeof(result_t), compare_bitrate);
+
+	gdouble low = log(MAX(a[0].bitrate, b[0].bitrate));
+	gdouble high = log(MIN(a[count - 1].bitrate, b[count - 1].bitrate));
+
+	if (high <= low) {
+		return false;
+	}
+
+	const guint steps = 64;
+	*gain = 0.0;
+
+	for (guint i = 0; i <= steps; i++) {
+		gdouble rate = low + (high - low) * i / steps;
+		*gain += interpolate(b, count, rate) - interpolate(a, count, rate);
+	}
+	*gain /= steps + 1;
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new("- evaluate the obs-vaapi lookahead");
+	GError *err = NULL;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gst_init_get_option_group());
+
+	if (!g_option_context_parse(context, &argc, &argv, &err)) {
+		g_printerr("%s\n", err->message);
+		g_printerr("%s", g_option_context_get_help(context, TRUE, NULL));
+		return 1;
+	}
+	g_option_context_free(context);
+
+	GstElement *encoder = gst_element_factory_make(encoder_name, NULL);
+	if (encoder == NULL) {
+		// Exit code for skipped under meson test
+		g_print("no such element: %s, skipped\n", encoder_name);
+		return 77;
+	}
+
+	lookahead_t lookahead;
+	bool supported = lookahead_set_constant_qp(encoder, 26) && lookahead_setup(&lookahead, encoder);
+	gst_object_unref(encoder);
+
+	if (!supported) {
+		g_printerr("%s has no constant QP mode the lookahead can adjust\n", encoder_name);
+		return 1;
+	}
+
+	eval_t eval = {0};
+	eval.encoder = encoder_name;
+	eval.codec = pipeline_get_codec(encoder_name);
+	eval.frames = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+
+	trace_t *trace = NULL;
+
+	if (trace_path) {
+		trace = trace_open(trace_path, &err);
+		if (trace == NULL) {
+			g_printerr("%s\n", err->message);
+			g_error_free(err);
+			return 1;
+		}
+	}
+
+	if (!(trace ? load_trace_frames(&eval, trace)
+		    : measure_load_synthetic(pattern, width, height, num_frames, eval.frames, &eval.caps))) {
+		g_printerr("no frames to encode\n");
+		return 1;
+	}
+
+	gst_video_info_from_caps(&eval.info, eval.caps);
+
+	if (!analyze_frames(&eval)) {
+		return 1;
+	}
+
+	gchar **list = g_strsplit(qps, ",", -1);
+	guint count = g_strv_length(list);
+	result_t *fixed = g_new0(result_t, count);
+	result_t *adaptive = g_new0(result_t, count);
+	guint keyframes_fixed = 0;
+	guint keyframes_adaptive = 0;
+	guint qp_changes = 0;
+	bool failed = false;
+
+	g_print("%s: %u frames, lookahead %d frames, QP offset by %s\n", encoder_name, eval.frames->len,
+		lookahead_frames, lookahead.roi ? "region of interest meta" : "property");
+	g_print("%4s %14s %7s %18s %7s %11s\n", "qp", "fixed kbit/s", "dB", "lookahead kbit/s", "dB", "qp changes");
+
+	for (guint i = 0; i < count; i++) {
+		guint qp = g_ascii_strtoull(list[i], NULL, 10);
+
+		run_qp(&eval, qp, false, &fixed[i]);
+		run_qp(&eval, qp, true, &adaptive[i]);
+
+		if (fixed[i].failed || adaptive[i].failed) {
+			g_print("%4u  failed\n", qp);
+			failed = true;
+			continue;
+		}
+
+		g_print("%4u %14.0f %7.2f %18.0f %7.2f %11u\n", qp, fixed[i].bitrate, fixed[i].psnr, adaptive[i].bitrate,
+			adaptive[i].psnr, adaptive[i].qp_changes);
+
+		keyframes_fixed += fixed[i].keyframes;
+		keyframes_adaptive += adaptive[i].keyframes;
+		qp_changes += adaptive[i].qp_changes;
+	}
+	g_strfreev(list);
+
+	gdouble gain;
+
+	if (failed) {
+		g_print("some runs failed, no comparison\n");
+	} else if (psnr_gain(fixed, adaptive, count, &gain)) {
+		g_print("lookahead at equal bitrate: %+.2f dB luma PSNR\n", gain);
+	} else {
+		g_print("bitrate ranges don't overlap, no comparison\n");
+	}
+
+	// Encoders with their own scene cut detection may differ by a few
+	// keyframes. Close to one extra per QP change means every change
+	// restarted the sequence.
+	g_print("keyframes: %u fixed, %u with lookahead and %u QP changes\n", keyframes_fixed, keyframes_adaptive,
+		qp_changes);
+	if (keyframes_adaptive > keyframes_fixed) {
+		g_print("%u extra keyframes, QP changes may restart the sequence on this encoder\n",
+			keyframes_adaptive - keyframes_fixed);
+	}
+
+	g_free(fixed);
+	g_free(adaptive);
+	g_free(eval.complexity);
+	g_ptr_array_free(eval.frames, TRUE);
+	gst_caps_unref(eval.caps);
+
+	if (trace) {
+		trace_close(trace);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "keyframe.h"
+
+// Requests this soon after a keyframe was sent are served by it
+#define KEYFRAME_FOLD_TIME G_USEC_PER_SEC
+
+void keyframe_request(keyframe_requests_t *k, gint64 now)
+{
+	// Fold into a request that was just sent to the encoder
+	if (k->inflight_time != 0 && now - k->sent_time < KEYFRAME_FOLD_TIME) {
+		k->inflight_requests++;
+		return;
+	}
+
+	if (k->request_time == 0) {
+		k->request_time = now;
+	}
+	k->requests++;
+}
+
+bool keyframe_is_due(const keyframe_requests_t *k, gint64 now)
+{
+	return k->request_time != 0 && (k->sent_time == 0 || now - k->sent_time >= k->interval);
+}
+
+bool keyframe_send(keyframe_requests_t *k, gint64 now, bool force)
+{
+	if (!force && !keyframe_is_due(k, now)) {
+		return false;
+	}
+
+	k->sent_time = now;
+	k->inflight_time = k->request_time;
+	k->inflight_requests = k->requests;
+	k->request_time = 0;
+	k->requests = 0;
+
+	return true;
+}
+
+guint keyframe_served(keyframe_requests_t *k, gint64 *request_time)
+{
+	guint requests = 0;
+
+	*request_time = 0;
+
+	if (k->inflight_time != 0) {
+		*request_time = k->inflight_time;
+		requests = k->inflight_requests;
+		k->inflight_time = 0;
+		k->inflight_requests = 0;
+	} else if (k->request_time != 0) {
+		// A regular keyframe serves pending requests just as well
+		*request_time = k->request_time;
+		requests = k->requests;
+		k->request_time = 0;
+		k->requests = 0;
+	}
+
+	return requests;
+}
@@ -0,0 +1,54 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Keyframe requests from outside, rate-limited and coalesced. Times are
+// monotonic microseconds passed in by the caller, so the rules can be
+// tested without a clock. Not thread-safe, the plugin locks around it.
+
+typedef struct {
+	// Minimum time between keyframes sent on request
+	gint64 interval;
+	// Oldest request not yet sent to the encoder, 0 if none
+	gint64 request_time;
+	guint requests;
+	// Last keyframe sent, 0 if none yet
+	gint64 sent_time;
+	// Oldest request of the keyframe on its way through the encoder
+	gint64 inflight_time;
+	guint inflight_requests;
+} keyframe_requests_t;
+
+void keyframe_request(keyframe_requests_t *k, gint64 now);
+
+// A pending request may go out now
+bool keyframe_is_due(const keyframe_requests_t *k, gint64 now);
+
+// Returns true if the encoder has to be asked for a keyframe, which is the
+// case when due or forced. Pending requests then ride along.
+bool keyframe_send(keyframe_requests_t *k, gint64 now, bool force);
+
+// The encoder output a keyframe. Returns the number of requests it served
+// and the time of the oldest one in request_time.
+guint keyframe_served(keyframe_requests_t *k, gint64 *request_time);
@@ -0,0 +1,201 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lookahead.h"
+
+#include <gst/video/video.h>
+#include <math.h>
+
+// Rate control modes with a QP to adjust per frame
+static const struct {
+	const char *property;
+	const char *mode;
+	const char *qps[3];
+	// Through a delta QP in a region of interest meta rather than the
+	// properties, which the VA encoders only apply with a new sequence
+	bool roi;
+} qp_modes[] = {
+	// va
+	{"rate-control", "cqp", {"qpi", "qpp", "qpb"}, true},
+	// vaapi (legacy)
+	{"rate-control", "cqp", {"init-qp"}, true},
+	// x264enc, constant rate factor. x264 applies changes between frames
+	// without a new sequence, which makes it a reference for evaluation.
+	{"pass", "qual", {"quantizer"}, false},
+};
+
+static bool has_qp(GstElement *encoder, const char *name)
+{
+	GParamSpec *spec = name ? g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), name) : NULL;
+
+	return spec != NULL && G_IS_PARAM_SPEC_UINT(spec);
+}
+
+// The encoder has the mode and at least one of its QPs, and is in it if active
+static bool has_mode(GstElement *encoder, guint index, bool active)
+{
+	GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), qp_modes[index].property);
+
+	if (spec == NULL || !G_IS_PARAM_SPEC_ENUM(spec)) {
+		return false;
+	}
+
+	GEnumValue *mode = g_enum_get_value_by_nick(G_PARAM_SPEC_ENUM(spec)->enum_class, qp_modes[index].mode);
+	if (mode == NULL) {
+		return false;
+	}
+
+	bool qps = false;
+	for (guint i = 0; i < G_N_ELEMENTS(qp_modes[index].qps); i++) {
+		qps |= has_qp(encoder, qp_modes[index].qps[i]);
+	}
+
+	if (!qps) {
+		return false;
+	} else if (!active) {
+		return true;
+	}
+
+	gint value;
+	g_object_get(encoder, qp_modes[index].property, &value, NULL);
+
+	return value == mode->value;
+}
+
+bool lookahead_setup(lookahead_t *lookahead, GstElement *encoder)
+{
+	*lookahead = (lookahead_t){0};
+
+	for (guint i = 0; i < G_N_ELEMENTS(qp_modes); i++) {
+		if (!has_mode(encoder, i, true)) {
+			continue;
+		}
+
+		for (guint j = 0; j < G_N_ELEMENTS(qp_modes[i].qps); j++) {
+			if (!has_qp(encoder, qp_modes[i].qps[j])) {
+				continue;
+			}
+
+			lookahead->qp_names[lookahead->qp_count] = qp_modes[i].qps[j];
+			g_object_get(encoder, qp_modes[i].qps[j], &lookahead->qp_base[lookahead->qp_count], NULL);
+			lookahead->qp_count++;
+		}
+
+		lookahead->roi = qp_modes[i].roi;
+
+		return true;
+	}
+
+	return false;
+}
+
+bool lookahead_set_constant_qp(GstElement *encoder, guint qp)
+{
+	for (guint i = 0; i < G_N_ELEMENTS(qp_modes); i++) {
+		if (!has_mode(encoder, i, false)) {
+			continue;
+		}
+
+		gst_util_set_object_arg(G_OBJECT(encoder), qp_modes[i].property, qp_modes[i].mode);
+
+		for (guint j = 0; j < G_N_ELEMENTS(qp_modes[i].qps); j++) {
+			if (has_qp(encoder, qp_modes[i].qps[j])) {
+				g_object_set(encoder, qp_modes[i].qps[j], qp, NULL);
+			}
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void lookahead_add(lookahead_t *lookahead, gdouble complexity)
+{
+	lookahead->complexity_average = lookahead->complexity_average == 0.0
+						? complexity
+						: lookahead->complexity_average * 0.98 + complexity * 0.02;
+}
+
+static void set_qps(lookahead_t *lookahead, GstElement *encoder)
+{
+	if (lookahead->roi) {
+		return;
+	}
+
+	for (guint i = 0; i < lookahead->qp_count; i++) {
+		GParamSpecUInt *spec = G_PARAM_SPEC_UINT(
+			g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), lookahead->qp_names[i]));
+
+		gint qp = CLAMP((gint)lookahead->qp_base[i] + lookahead->qp_offset, (gint)spec->minimum,
+				(gint)MIN(spec->maximum, G_MAXINT));
+
+		g_object_set(encoder, lookahead->qp_names[i], (guint)qp, NULL);
+	}
+}
+
+// Like x264's qcomp of 0.6 the QP follows complexity^0.4 relative to the
+// long term average, so busy stretches that mask artifacts get fewer bits
+// and calm ones more.
+bool lookahead_update(lookahead_t *lookahead, GstElement *encoder, gdouble complexity)
+{
+	if (lookahead->qp_count == 0 || lookahead->complexity_average <= 0.0) {
+		return false;
+	}
+
+	gint offset = lround(
+		CLAMP(6.0 * 0.4 * log2(MAX(complexity, 0.01) / lookahead->complexity_average), -6.0, 6.0));
+
+	// Encoders may reconfigure on property changes, avoid jitter
+	if (offset == lookahead->qp_offset || (!lookahead->roi && ABS(offset - lookahead->qp_offset) < 2)) {
+		return false;
+	}
+
+	lookahead->qp_offset = offset;
+	set_qps(lookahead, encoder);
+
+	return true;
+}
+
+void lookahead_apply(lookahead_t *lookahead, GstBuffer *buffer, guint width, guint height)
+{
+	if (!lookahead->roi || lookahead->qp_count == 0 || lookahead->qp_offset == 0) {
+		return;
+	}
+
+	// The whole frame, for the va and the legacy vaapi encoders
+	GstVideoRegionOfInterestMeta *meta =
+		gst_buffer_add_video_region_of_interest_meta(buffer, "lookahead", 0, 0, width, height);
+
+	gst_video_region_of_interest_meta_add_param(
+		meta, gst_structure_new("roi/va", "delta-qp", G_TYPE_INT, lookahead->qp_offset, NULL));
+	gst_video_region_of_interest_meta_add_param(
+		meta, gst_structure_new("roi/vaapi", "delta-qp", G_TYPE_INT, lookahead->qp_offset, NULL));
+}
+
+void lookahead_disable(lookahead_t *lookahead, GstElement *encoder)
+{
+	if (lookahead->qp_offset != 0) {
+		lookahead->qp_offset = 0;
+		set_qps(lookahead, encoder);
+	}
+
+	lookahead->qp_count = 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gst/gst.h>
+#include <stdbool.h>
+
+// QP adjustment from the complexity of upcoming frames. Only GStreamer in
+// here, so the plugin and obs-vaapi-eval run the same logic.
+
+typedef struct {
+	gdouble complexity_average;
+	gint qp_offset;
+	guint qp_count;
+	const gchar *qp_names[3];
+	guint qp_base[3];
+	bool roi;
+} lookahead_t;
+
+// Picks up the QP properties and their current values if the encoder is in
+// a constant QP mode. Returns false otherwise.
+bool lookahead_setup(lookahead_t *lookahead, GstElement *encoder);
+
+// Puts the encoder into constant QP mode at qp, e.g. for an evaluation run
+bool lookahead_set_constant_qp(GstElement *encoder, guint qp);
+
+// Feeds the long term average with every frame as it comes in
+void lookahead_add(lookahead_t *lookahead, gdouble complexity);
+
+// Picks the QP offset for the next frame from the mean complexity of the
+// frames ahead and sets the QP properties where they apply per frame.
+// Returns true if the offset changed.
+bool lookahead_update(lookahead_t *lookahead, GstElement *encoder, gdouble complexity);
+
+// Carries the offset on the frame itself where properties don't work
+void lookahead_apply(lookahead_t *lookahead, GstBuffer *buffer, guint width, guint height);
+
+// Back to the base QPs and no further changes
+void lookahead_disable(lookahead_t *lookahead, GstElement *encoder);
@@ -0,0 +1,205 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "measure.h"
+
+#include <gst/app/app.h>
+#include <math.h>
+
+static bool load_pattern(const gchar *pattern, gint width, gint height, gint frames, GPtrArray *buffers,
+			 GstCaps **caps)
+{
+	gchar *description = g_strdup_printf("videotestsrc pattern=%s num-buffers=%d ! "
+					     "video/x-raw,format=NV12,width=%d,height=%d,framerate=30/1 ! "
+					     "appsink name=sink sync=false",
+					     pattern, frames, width, height);
+	GError *err = NULL;
+
+	GstElement *pipe = gst_parse_launch(description, &err);
+	g_free(description);
+
+	if (pipe == NULL) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return false;
+	}
+
+	GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipe), "sink");
+
+	gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+	GstSample *sample;
+	while ((sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink))) != NULL) {
+		if (*caps == NULL) {
+			*caps = gst_caps_ref(gst_sample_get_caps(sample));
+		}
+		g_ptr_array_add(buffers, gst_buffer_ref(gst_sample_get_buffer(sample)));
+		gst_sample_unref(sample);
+	}
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(appsink);
+	gst_object_unref(pipe);
+
+	return *caps != NULL;
+}
+
+bool measure_load_synthetic(const gchar *patterns, gint width, gint height, gint frames, GPtrArray *buffers,
+			    GstCaps **caps)
+{
+	gchar **list = g_strsplit(patterns, ",", -1);
+	bool ok = true;
+
+	for (gchar **pattern = list; *pattern && ok; pattern++) {
+		ok = load_pattern(*pattern, width, height, frames, buffers, caps);
+	}
+
+	g_strfreev(list);
+
+	return ok;
+}
+
+bool measure_pop_error(GstBus *bus, GstClockTime timeout, GstMessageType types)
+{
+	GstMessage *message = gst_bus_timed_pop_filtered(bus, timeout, types | GST_MESSAGE_ERROR);
+
+	if (message == NULL) {
+		return false;
+	}
+
+	bool error = GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR;
+
+	if (error) {
+		GError *err = NULL;
+		gst_message_parse_error(message, &err, NULL);
+		g_printerr("  %s\n", err->message);
+		g_error_free(err);
+	}
+
+	gst_message_unref(message);
+
+	return error;
+}
+
+static void pad_added(GstElement *decodebin, GstPad *pad, gpointer user_data)
+{
+	GstElement *convert = user_data;
+	GstPad *sinkpad = gst_element_get_static_pad(convert, "sink");
+
+	if (!gst_pad_is_linked(sinkpad)) {
+		gst_pad_link(pad, sinkpad);
+	}
+
+	gst_object_unref(sinkpad);
+}
+
+// First component, luma for YUV, of 8 to 16 bit formats
+static gint get_sample(GstVideoFrame *frame, guint x, guint y)
+{
+	const guint8 *data = (const guint8 *)GST_VIDEO_FRAME_COMP_DATA(frame, 0) +
+			     y * GST_VIDEO_FRAME_COMP_STRIDE(frame, 0) + x * GST_VIDEO_FRAME_COMP_PSTRIDE(frame, 0);
+
+	if (GST_VIDEO_FRAME_COMP_DEPTH(frame, 0) <= 8) {
+		return *data;
+	}
+
+	guint16 value = *(const guint16 *)data;
+	if (GST_VIDEO_FORMAT_INFO_IS_LE(frame->info.finfo) != (G_BYTE_ORDER == G_LITTLE_ENDIAN)) {
+		value = GUINT16_SWAP_LE_BE(value);
+	}
+
+	return value >> GST_VIDEO_FORMAT_INFO_SHIFT(frame->info.finfo, 0);
+}
+
+gdouble measure_psnr(GPtrArray *frames, const GstVideoInfo *info, GPtrArray *packets, GstCaps *packet_caps)
+{
+	GstElement *pipe = gst_pipeline_new(NULL);
+	GstElement *appsrc = gst_element_factory_make("appsrc", NULL);
+	GstElement *decodebin = gst_element_factory_make("decodebin", NULL);
+	GstElement *convert = gst_element_factory_make("videoconvert", NULL);
+	GstElement *appsink = gst_element_factory_make("appsink", NULL);
+
+	// Decoded to the source's format and colorimetry, so the range and
+	// matrix match and the first component compares as it is
+	GstCaps *caps = gst_video_info_to_caps(info);
+	gst_structure_remove_field(gst_caps_get_structure(caps, 0), "framerate");
+	g_object_set(appsink, "caps", caps, "sync", FALSE, NULL);
+	gst_caps_unref(caps);
+
+	g_object_set(appsrc, "caps", packet_caps, "max-bytes", (guint64)0, NULL);
+	gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+	gst_bin_add_many(GST_BIN(pipe), appsrc, decodebin, convert, appsink, NULL);
+	gst_element_link(appsrc, decodebin);
+	gst_element_link(convert, appsink);
+	g_signal_connect(decodebin, "pad-added", G_CALLBACK(pad_added), convert);
+
+	gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+	for (guint i = 0; i < packets->len; i++) {
+		gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_ref(g_ptr_array_index(packets, i)));
+	}
+	gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+	gdouble psnr = 0.0;
+	guint decoded_frames = 0;
+	GstSample *sample;
+
+	while (decoded_frames < frames->len &&
+	       (sample = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink), 10 * GST_SECOND)) != NULL) {
+		GstVideoInfo decoded_info;
+		GstVideoFrame decoded;
+		GstVideoFrame source;
+
+		gst_video_info_from_caps(&decoded_info, gst_sample_get_caps(sample));
+
+		if (gst_video_frame_map(&decoded, &decoded_info, gst_sample_get_buffer(sample), GST_MAP_READ)) {
+			if (gst_video_frame_map(&source, (GstVideoInfo *)info, g_ptr_array_index(frames, decoded_frames),
+						GST_MAP_READ)) {
+				guint w = MIN(GST_VIDEO_FRAME_WIDTH(&decoded), GST_VIDEO_FRAME_WIDTH(&source));
+				guint h = MIN(GST_VIDEO_FRAME_HEIGHT(&decoded), GST_VIDEO_FRAME_HEIGHT(&source));
+				guint depth = GST_VIDEO_INFO_COMP_DEPTH(info, 0);
+				guint64 sum = 0;
+
+				for (guint y = 0; y < h; y++) {
+					for (guint x = 0; x < w; x++) {
+						gint d = get_sample(&decoded, x, y) - get_sample(&source, x, y);
+						sum += (gint64)d * d;
+					}
+				}
+
+				gdouble peak = (1 << depth) - 1;
+				gdouble mse = (gdouble)sum / (w * h);
+				psnr += mse > 0.0 ? 10.0 * log10(peak * peak / mse) : 100.0;
+
+				gst_video_frame_unmap(&source);
+			}
+			gst_video_frame_unmap(&decoded);
+		}
+
+		gst_sample_unref(sample);
+		decoded_frames++;
+	}
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(pipe);
+
+	return decoded_frames ? psnr / decoded_frames : 0.0;
+}
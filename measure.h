@@ -0,0 +1,40 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <stdbool.h>
+
+// Source frames and quality measurement shared by the tools
+
+// Frames of each of the comma separated videotestsrc patterns in turn, so
+// content of different complexity can follow each other
+bool measure_load_synthetic(const gchar *patterns, gint width, gint height, gint frames, GPtrArray *buffers,
+			    GstCaps **caps);
+
+// Average luma PSNR of the packets, decoded to the format and colorimetry
+// of the source frames, against them
+gdouble measure_psnr(GPtrArray *frames, const GstVideoInfo *info, GPtrArray *packets, GstCaps *packet_caps);
+
+// Waits for a message of the given types or an error. Returns true and
+// prints it on an error.
+bool measure_pop_error(GstBus *bus, GstClockTime timeout, GstMessageType types);
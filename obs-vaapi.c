@@ -20,29 +20,102 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <gst/app/app.h>
 #include <gst/gst.h>
 #include <gst/video/video.h>
+#include <math.h>
 #include <obs/obs-module.h>
 #include <pci/pci.h>
+#include <unistd.h>
+
+#include "analysis.h"
+#include "drop.h"
+#include "keyframe.h"
+#include "lookahead.h"
+#include "pipeline.h"
+#include "trace.h"
 
 OBS_DECLARE_MODULE()
 
 static GHashTable *hash_table;
 
+// Running instances by obs_encoder_t, for proc handlers that outlive them
+static GHashTable *instances;
+static GMutex instances_mutex;
+
+// OBS encoders that got the proc handler, which lives as long as they do.
+// Weak references, so a new encoder at a freed one's address doesn't count.
+static GHashTable *proc_handlers;
+
 typedef struct {
 	obs_encoder_t *encoder;
 	GstElement *pipe;
+	GstElement *vaapiencoder;
 	GstElement *appsrc;
 	GstElement *appsink;
 	GstSample *sample;
 	GstMapInfo info;
 	GMutex mutex;
 	GCond cond;
+	bool consumed;
 	void *codec_data;
 	size_t codec_size;
+	bool low_latency;
+	bool latency_checked;
+	GstClockTime latency_budget;
+	guint64 late_frames;
+	gint64 late_warning_time;
+	GstClockTime latency_pts[16];
+	gint64 latency_push_time[16];
+	guint latency_slot;
+	GstClockTime output_pts;
+	bool latency_behind;
+	keyframe_requests_t keyframes;
+	bool drop_frames;
+	gsize buffer_size;
+	drop_t drop;
+	guint gop_frames;
+	int64_t last_keyframe_pts;
+	guint64 frames;
+	guint64 frames_dropped;
+	guint dropped_since_keyframe;
+	gint64 drop_warning_time;
+	bool scene_detect;
+	gdouble scene_threshold;
+	int64_t scene_min_frames;
+	analysis_t *analysis;
+	guint64 scene_cuts;
+	gint64 analysis_time;
+	guint64 analysis_frames;
+	guint lookahead;
+	GstVideoInfo lookahead_info;
+	GQueue lookahead_queue;
+	lookahead_t lookahead_qp;
+	GstClockTime qp_change_pts;
+	bool qp_change_keyframe;
+	guint64 qp_changes;
+	GstElement *backup_bin;
+	GstElement *backup_queue;
+	gint backup_failed;
+	bool backup_dropping;
+	guint64 backup_dropped;
+	gint64 backup_drop_log_time;
+	gint backup_overruns;
+	obs_data_t *trace_settings;
+	trace_t *trace;
+	guint64 trace_skipped;
 } obs_vaapi_t;
 
+typedef struct {
+	obs_vaapi_t *vaapi;
+	void *data;
+	GstBuffer *buffer;
+	gdouble complexity;
+	bool force_keyframe;
+} lookahead_frame_t;
+
 static GstVideoFormat map_video_format(enum video_format format)
 {
 	switch (format) {
@@ -63,6 +136,23 @@ static GstVideoFormat map_video_format(enum video_format format)
 	}
 }
 
+static gsize get_buffer_size(enum video_format format, uint32_t width, uint32_t height)
+{
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+	case VIDEO_FORMAT_NV12:
+		return width * height * 3 / 2;
+	case VIDEO_FORMAT_I444:
+	case VIDEO_FORMAT_P010:
+	case VIDEO_FORMAT_I010:
+		return width * height * 3;
+	case VIDEO_FORMAT_BGRA:
+		return width * height * 4;
+	default:
+		return 0;
+	}
+}
+
 static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer user_data)
 {
 	GError *err = NULL;
@@ -85,11 +175,565 @@ static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer user_dat
 	return TRUE;
 }
 
+static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *message, gpointer user_data)
+{
+	obs_vaapi_t *vaapi = user_data;
+
+	// Runs in the failing streaming thread, so the backup branch is cut
+	// off before its flow error can travel back up the tee.
+	if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR && vaapi->backup_bin != NULL &&
+	    gst_object_has_as_ancestor(GST_MESSAGE_SRC(message), GST_OBJECT(vaapi->backup_bin)) &&
+	    g_atomic_int_compare_and_exchange(&vaapi->backup_failed, FALSE, TRUE)) {
+		blog(LOG_ERROR, "[obs-vaapi] backup recording failed, stopped");
+	}
+
+	return GST_BUS_PASS;
+}
+
+#define BACKUP_DROP_LEVEL (5 * GST_SECOND)
+
+// A slow disk must never stall encode(). Once the queue holds too much,
+// whole GOPs are dropped up to the next keyframe, so the backup skips
+// instead of carrying undecodable frames.
+static GstPadProbeReturn backup_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	obs_vaapi_t *vaapi = user_data;
+
+	if (g_atomic_int_get(&vaapi->backup_failed)) {
+		return GST_PAD_PROBE_DROP;
+	}
+
+	GstBuffer *buffer;
+	guint count = 1;
+
+	if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		count = gst_buffer_list_length(list);
+		if (count == 0) {
+			return GST_PAD_PROBE_OK;
+		}
+		buffer = gst_buffer_list_get(list, 0);
+	} else {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	}
+
+	bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+	guint64 level;
+	g_object_get(vaapi->backup_queue, "current-level-time", &level, NULL);
+
+	if (vaapi->backup_dropping && keyframe && level < BACKUP_DROP_LEVEL) {
+		vaapi->backup_dropping = false;
+	} else if (!vaapi->backup_dropping && level >= BACKUP_DROP_LEVEL) {
+		vaapi->backup_dropping = true;
+
+		gint64 now = g_get_monotonic_time();
+		if (now - vaapi->backup_drop_log_time >= 10 * G_USEC_PER_SEC) {
+			blog(LOG_WARNING,
+			     "[obs-vaapi] backup recording: disk too slow, dropping up to the next keyframe, %" G_GUINT64_FORMAT
+			     " buffers dropped so far",
+			     vaapi->backup_dropped);
+			vaapi->backup_drop_log_time = now;
+		}
+	}
+
+	if (vaapi->backup_dropping) {
+		vaapi->backup_dropped += count;
+		return GST_PAD_PROBE_DROP;
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+// The leaky queue is the last resort if dropping GOPs isn't enough, every
+// overrun loses buffers from the middle of a GOP
+static void backup_overrun(GstElement *queue, gpointer user_data)
+{
+	obs_vaapi_t *vaapi = user_data;
+
+	if (g_atomic_int_add(&vaapi->backup_overruns, 1) == 0) {
+		blog(LOG_WARNING, "[obs-vaapi] backup recording: queue overrun, losing data");
+	}
+}
+
+static GstElement *create_backup_bin(obs_vaapi_t *vaapi, obs_data_t *settings)
+{
+	const char *codec = obs_encoder_get_codec(vaapi->encoder);
+	const char *path = obs_data_get_string(settings, "backup-path");
+	bool mp4 = g_strcmp0(obs_data_get_string(settings, "backup-format"), "mp4") == 0;
+
+	// Fail here rather than have the sink fail in the running pipeline
+	if (g_mkdir_with_parents(path, 0755) != 0 || g_access(path, W_OK) != 0) {
+		blog(LOG_ERROR, "[obs-vaapi] backup recording: can't write to %s: %s", path, g_strerror(errno));
+		return NULL;
+	}
+
+	GstElement *queue = gst_element_factory_make("queue", NULL);
+	GstElement *parser = pipeline_make_parser(codec);
+	GstElement *sink = gst_element_factory_make("splitmuxsink", NULL);
+
+	if (queue == NULL || parser == NULL || sink == NULL) {
+		blog(LOG_ERROR, "[obs-vaapi] backup recording: missing GStreamer elements");
+
+		if (queue) {
+			gst_object_unref(gst_object_ref_sink(queue));
+		}
+		if (parser) {
+			gst_object_unref(gst_object_ref_sink(parser));
+		}
+		if (sink) {
+			gst_object_unref(gst_object_ref_sink(sink));
+		}
+		return NULL;
+	}
+
+	// Room above the drop level for the GOP in flight. Rather lose the
+	// oldest data in the backup than block the tee.
+	g_object_set(queue, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", 2 * BACKUP_DROP_LEVEL, NULL);
+	gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+	g_signal_connect(queue, "overrun", G_CALLBACK(backup_overrun), vaapi);
+	vaapi->backup_queue = queue;
+
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *date = g_date_time_format(now, "%Y-%m-%d_%H-%M-%S");
+	gchar *location = g_strdup_printf("%s/obs-vaapi-%s-%%05d.%s", path, date, mp4 ? "mp4" : "ts");
+	g_free(date);
+	g_date_time_unref(now);
+
+	g_object_set(sink, "location", location, "max-size-time",
+		     obs_data_get_int(settings, "backup-segment-duration") * GST_SECOND, "muxer-factory",
+		     mp4 ? "mp4mux" : "mpegtsmux", NULL);
+
+	if (mp4) {
+		// Fragments keep the file readable if OBS goes down
+		GstStructure *muxer = gst_structure_new("properties", "fragment-duration", G_TYPE_UINT, 1000, NULL);
+		g_object_set(sink, "muxer-properties", muxer, NULL);
+		gst_structure_free(muxer);
+	}
+
+	blog(LOG_INFO, "[obs-vaapi] backup recording: %s", location);
+	g_free(location);
+
+	GstElement *bin = gst_bin_new("backup");
+	gst_bin_add_many(GST_BIN(bin), queue, parser, sink, NULL);
+	gst_element_link_many(queue, parser, sink, NULL);
+
+	GstPad *pad = gst_element_get_static_pad(queue, "sink");
+	GstPad *ghost = gst_ghost_pad_new("sink", pad);
+	gst_object_unref(pad);
+
+	gst_pad_add_probe(ghost, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, backup_probe, vaapi,
+			  NULL);
+	gst_element_add_pad(bin, ghost);
+
+	return bin;
+}
+
+// Cuts the backup off the tee, e.g. when it couldn't start
+static void remove_backup_bin(obs_vaapi_t *vaapi)
+{
+	GstPad *pad = gst_element_get_static_pad(vaapi->backup_bin, "sink");
+	GstPad *tee_pad = gst_pad_get_peer(pad);
+
+	g_atomic_int_set(&vaapi->backup_failed, TRUE);
+
+	if (tee_pad) {
+		GstElement *tee = gst_pad_get_parent_element(tee_pad);
+
+		gst_pad_unlink(tee_pad, pad);
+		gst_element_release_request_pad(tee, tee_pad);
+
+		gst_object_unref(tee);
+		gst_object_unref(tee_pad);
+	}
+	gst_object_unref(pad);
+
+	gst_element_set_state(vaapi->backup_bin, GST_STATE_NULL);
+	gst_bin_remove(GST_BIN(vaapi->pipe), vaapi->backup_bin);
+	vaapi->backup_bin = NULL;
+	vaapi->backup_queue = NULL;
+}
+
+// Current encoder properties and the plugin options in effect, for
+// replaying a trace
+static gchar *get_trace_settings(obs_vaapi_t *vaapi, obs_data_t *settings)
+{
+	GstElement *encoder = vaapi->vaapiencoder;
+	GKeyFile *key_file = g_key_file_new();
+
+	guint num_properties;
+	GParamSpec **property_specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(encoder), &num_properties);
+
+	for (guint i = 0; i < num_properties; i++) {
+		GParamSpec *param = property_specs[i];
+
+		if (param->owner_type == G_TYPE_OBJECT || param->owner_type == GST_TYPE_OBJECT ||
+		    param->owner_type == GST_TYPE_PAD || (param->flags & G_PARAM_WRITABLE) == 0 ||
+		    (param->flags & G_PARAM_READABLE) == 0) {
+			continue;
+		}
+
+		GValue value = G_VALUE_INIT;
+		g_value_init(&value, param->value_type);
+		g_object_get_property(G_OBJECT(encoder), param->name, &value);
+
+		gchar *str = gst_value_serialize(&value);
+		if (str != NULL) {
+			g_key_file_set_string(key_file, "encoder", param->name, str);
+			g_free(str);
+		}
+
+		g_value_unset(&value);
+	}
+
+	g_free(property_specs);
+
+	g_key_file_set_boolean(key_file, "plugin", "low-latency-mode", vaapi->low_latency);
+	g_key_file_set_int64(key_file, "plugin", "latency-budget", vaapi->latency_budget / GST_MSECOND);
+	g_key_file_set_boolean(key_file, "plugin", "scene-cut-detection", vaapi->scene_detect);
+	g_key_file_set_double(key_file, "plugin", "scene-cut-threshold", vaapi->scene_threshold);
+	g_key_file_set_int64(key_file, "plugin", "scene-cut-min-interval",
+			     obs_data_get_int(settings, "scene-cut-min-interval"));
+	g_key_file_set_integer(key_file, "plugin", "lookahead", vaapi->lookahead);
+	g_key_file_set_boolean(key_file, "plugin", "drop-frames-on-overload", vaapi->drop_frames);
+	g_key_file_set_string(key_file, "plugin", "postproc", obs_data_get_string(settings, "postproc"));
+	g_key_file_set_string(key_file, "plugin", "postproc-quality",
+			      obs_data_get_string(settings, "postproc-quality"));
+
+	gchar *data = g_key_file_to_data(key_file, NULL, NULL);
+	g_key_file_free(key_file);
+
+	return data;
+}
+
+// Created with the first frame, the slot size depends on OBS' strides
+static trace_t *create_trace(obs_vaapi_t *vaapi, struct encoder_frame *frame)
+{
+	obs_data_t *settings = vaapi->trace_settings;
+	struct obs_video_info video_info;
+	obs_get_video_info(&video_info);
+
+	trace_header_t info = {0};
+
+	info.width = obs_encoder_get_width(vaapi->encoder);
+	info.height = obs_encoder_get_height(vaapi->encoder);
+	info.format = map_video_format(video_info.output_format);
+	info.fps_num = video_info.fps_num;
+	info.fps_den = video_info.fps_den;
+	info.timebase_num = video_info.fps_den;
+	info.timebase_den = video_info.fps_num;
+	info.slot_count = obs_data_get_int(settings, "trace-duration") * video_info.fps_num / video_info.fps_den;
+	info.slot_count = MAX(info.slot_count, 1);
+
+	GstVideoInfo video;
+	gst_video_info_set_format(&video, info.format, info.width, info.height);
+
+	for (guint c = 0; c < GST_VIDEO_INFO_N_COMPONENTS(&video); c++) {
+		guint plane = GST_VIDEO_INFO_COMP_PLANE(&video, c);
+		info.plane_height[plane] = MAX(info.plane_height[plane], GST_VIDEO_INFO_COMP_HEIGHT(&video, c));
+	}
+
+	info.frame_size = trace_get_frame_size(frame->data, frame->linesize, info.plane_height);
+	if (info.frame_size == 0) {
+		blog(LOG_ERROR, "[obs-vaapi] trace: unexpected frame layout, disabled");
+		return NULL;
+	}
+
+	GstCaps *caps = gst_app_src_get_caps(GST_APP_SRC(vaapi->appsrc));
+	const gchar *colorimetry = gst_structure_get_string(gst_caps_get_structure(caps, 0), "colorimetry");
+	if (colorimetry) {
+		g_strlcpy(info.colorimetry, colorimetry, sizeof(info.colorimetry));
+	}
+	gst_caps_unref(caps);
+
+	g_strlcpy(info.encoder, GST_OBJECT_NAME(gst_element_get_factory(vaapi->vaapiencoder)), sizeof(info.encoder));
+	g_strlcpy(info.codec, obs_encoder_get_codec(vaapi->encoder), sizeof(info.codec));
+
+	// One file per encoder, each session overwrites the previous one so
+	// traces don't pile up
+	const gchar *dir = obs_data_get_string(settings, "trace-path");
+	if (g_mkdir_with_parents(dir, 0755) != 0) {
+		blog(LOG_ERROR, "[obs-vaapi] trace: cannot create %s: %s", dir, g_strerror(errno));
+		return NULL;
+	}
+
+	gchar *name = g_strcanon(g_strdup(obs_encoder_get_name(vaapi->encoder)),
+				 G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_", '_');
+	gchar *file = g_strdup_printf("obs-vaapi-%s.trace", name);
+	gchar *path = g_build_filename(dir, file, NULL);
+	g_free(file);
+	g_free(name);
+
+	gchar *encoder_settings = get_trace_settings(vaapi, settings);
+	GError *err = NULL;
+
+	trace_t *trace = trace_create(path, &info, encoder_settings, obs_data_get_json(settings), &err);
+	if (trace == NULL) {
+		blog(LOG_ERROR, "[obs-vaapi] trace: %s", err->message);
+		g_error_free(err);
+	} else {
+		blog(LOG_INFO, "[obs-vaapi] trace: %s, %" G_GUINT64_FORMAT " frames", path, (guint64)info.slot_count);
+	}
+
+	g_free(encoder_settings);
+	g_free(path);
+
+	return trace;
+}
+
 static void enough_data()
 {
 	blog(LOG_WARNING, "[obs-vaapi] encoder overload");
 }
 
+static void check_latency(obs_vaapi_t *vaapi)
+{
+	GstQuery *query = gst_query_new_latency();
+
+	if (!gst_element_query(vaapi->pipe, query)) {
+		blog(LOG_WARNING, "[obs-vaapi] low-latency: latency query failed");
+		gst_query_unref(query);
+		return;
+	}
+
+	gboolean live;
+	GstClockTime min_latency;
+	GstClockTime max_latency;
+
+	gst_query_parse_latency(query, &live, &min_latency, &max_latency);
+	gst_query_unref(query);
+
+	if (min_latency > vaapi->latency_budget) {
+		blog(LOG_WARNING,
+		     "[obs-vaapi] low-latency: pipeline latency %" GST_TIME_FORMAT " exceeds budget %" GST_TIME_FORMAT,
+		     GST_TIME_ARGS(min_latency), GST_TIME_ARGS(vaapi->latency_budget));
+	} else {
+		blog(LOG_INFO,
+		     "[obs-vaapi] low-latency: pipeline latency %" GST_TIME_FORMAT ", budget %" GST_TIME_FORMAT,
+		     GST_TIME_ARGS(min_latency), GST_TIME_ARGS(vaapi->latency_budget));
+	}
+}
+
+// Measures push to packet for every frame in the streaming thread, so
+// encode() doesn't have to wait for packets to know they were late.
+static GstPadProbeReturn latency_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	obs_vaapi_t *vaapi = user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	gint64 now = g_get_monotonic_time();
+	gint64 push_time = 0;
+
+	if (!GST_BUFFER_PTS_IS_VALID(buffer)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	g_mutex_lock(&vaapi->mutex);
+
+	for (guint i = 0; i < G_N_ELEMENTS(vaapi->latency_pts); i++) {
+		if (vaapi->latency_pts[i] == GST_BUFFER_PTS(buffer)) {
+			push_time = vaapi->latency_push_time[i];
+			vaapi->latency_pts[i] = GST_CLOCK_TIME_NONE;
+			break;
+		}
+	}
+
+	GstClockTime latency = push_time ? (now - push_time) * GST_USECOND : 0;
+	bool late = latency > vaapi->latency_budget;
+
+	vaapi->output_pts = GST_BUFFER_PTS(buffer);
+	vaapi->latency_behind = late;
+	g_cond_signal(&vaapi->cond);
+
+	g_mutex_unlock(&vaapi->mutex);
+
+	if (late) {
+		vaapi->late_frames++;
+
+		if (now - vaapi->late_warning_time > G_USEC_PER_SEC) {
+			blog(LOG_WARNING,
+			     "[obs-vaapi] low-latency: frame took %" GST_TIME_FORMAT ", limit %" GST_TIME_FORMAT
+			     " (%" G_GUINT64_FORMAT " late frames)",
+			     GST_TIME_ARGS(latency), GST_TIME_ARGS(vaapi->latency_budget), vaapi->late_frames);
+			vaapi->late_warning_time = now;
+		}
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void request_keyframe(obs_vaapi_t *vaapi)
+{
+	g_mutex_lock(&vaapi->mutex);
+	keyframe_request(&vaapi->keyframes, g_get_monotonic_time());
+	g_mutex_unlock(&vaapi->mutex);
+}
+
+static void request_keyframe_proc(void *data, calldata_t *cd)
+{
+	g_mutex_lock(&instances_mutex);
+
+	obs_vaapi_t *vaapi = g_hash_table_lookup(instances, data);
+	if (vaapi != NULL) {
+		request_keyframe(vaapi);
+	}
+
+	g_mutex_unlock(&instances_mutex);
+}
+
+// Must be called with vaapi->mutex held. Keyframes the plugin places
+// itself are forced past the rate limit, pending requests ride along.
+static void send_keyframe_request(obs_vaapi_t *vaapi, bool force)
+{
+	if (keyframe_send(&vaapi->keyframes, g_get_monotonic_time(), force)) {
+		pipeline_force_keyframe(vaapi->vaapiencoder);
+	}
+}
+
+static void keyframe_done(obs_vaapi_t *vaapi)
+{
+	gint64 request_time;
+
+	g_mutex_lock(&vaapi->mutex);
+	guint requests = keyframe_served(&vaapi->keyframes, &request_time);
+	g_mutex_unlock(&vaapi->mutex);
+
+	if (requests != 0) {
+		blog(LOG_INFO, "[obs-vaapi] keyframe request served after %" G_GINT64_FORMAT " ms (%u requests)",
+		     (g_get_monotonic_time() - request_time) / G_TIME_SPAN_MILLISECOND, requests);
+	}
+}
+
+static bool keyframe_due(obs_vaapi_t *vaapi)
+{
+	g_mutex_lock(&vaapi->mutex);
+	bool due = keyframe_is_due(&vaapi->keyframes, g_get_monotonic_time());
+	g_mutex_unlock(&vaapi->mutex);
+
+	return due;
+}
+
+static bool drop_frame(obs_vaapi_t *vaapi)
+{
+	if (!drop_next_frame(&vaapi->drop, keyframe_due(vaapi))) {
+		return false;
+	}
+
+	vaapi->frames_dropped++;
+	vaapi->dropped_since_keyframe++;
+
+	if (g_get_monotonic_time() - vaapi->drop_warning_time > 10 * G_USEC_PER_SEC) {
+		blog(LOG_WARNING,
+		     "[obs-vaapi] encoder overload, dropped %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames",
+		     vaapi->frames_dropped, vaapi->frames);
+		vaapi->drop_warning_time = g_get_monotonic_time();
+	}
+
+	return true;
+}
+
+static void analyze_frame(obs_vaapi_t *vaapi, struct encoder_frame *frame, gdouble *temporal, gdouble *spatial)
+{
+	gint64 start = g_get_monotonic_time();
+
+	analysis_frame(vaapi->analysis, frame->data[0], frame->linesize[0], temporal, spatial);
+
+	vaapi->analysis_time += g_get_monotonic_time() - start;
+	vaapi->analysis_frames++;
+}
+
+static bool detect_scene_cut(obs_vaapi_t *vaapi, struct encoder_frame *frame, gdouble temporal)
+{
+	bool cut = analysis_is_scene_cut(temporal, vaapi->scene_threshold, frame->pts - vaapi->last_keyframe_pts,
+					 vaapi->scene_min_frames);
+
+	if (cut) {
+		vaapi->scene_cuts++;
+	}
+
+	return cut;
+}
+
+static void lookahead_notify(void *data)
+{
+	lookahead_frame_t *entry = data;
+	obs_vaapi_t *vaapi = entry->vaapi;
+
+	g_free(entry->data);
+	g_free(entry);
+
+	g_mutex_lock(&vaapi->mutex);
+	vaapi->consumed = true;
+	g_cond_signal(&vaapi->cond);
+	g_mutex_unlock(&vaapi->mutex);
+}
+
+static void lookahead_push(obs_vaapi_t *vaapi, struct encoder_frame *frame, GstClockTime pts, gdouble complexity,
+			   bool force_keyframe)
+{
+	GstVideoInfo *info = &vaapi->lookahead_info;
+	gsize size = GST_VIDEO_INFO_SIZE(info);
+	lookahead_frame_t *entry = g_new0(lookahead_frame_t, 1);
+
+	// OBS reuses the frame memory after encode() returns. The copy gets
+	// the default layout, OBS's lines may be padded.
+	entry->vaapi = vaapi;
+	entry->data = g_malloc(size);
+	entry->complexity = complexity;
+	entry->force_keyframe = force_keyframe;
+
+	for (guint i = 0; i < GST_VIDEO_INFO_N_PLANES(info); i++) {
+		gsize offset = GST_VIDEO_INFO_PLANE_OFFSET(info, i);
+		gsize end = i + 1 < GST_VIDEO_INFO_N_PLANES(info) ? GST_VIDEO_INFO_PLANE_OFFSET(info, i + 1) : size;
+		gsize stride = GST_VIDEO_INFO_PLANE_STRIDE(info, i);
+		gsize width = MIN(stride, (gsize)frame->linesize[i]);
+
+		for (gsize row = 0; row < (end - offset) / stride; row++) {
+			memcpy((guint8 *)entry->data + offset + row * stride, frame->data[i] + row * frame->linesize[i],
+			       width);
+		}
+	}
+
+	entry->buffer = gst_buffer_new_wrapped_full(0, entry->data, size, 0, size, entry, lookahead_notify);
+	gst_buffer_add_video_meta_full(entry->buffer, 0, GST_VIDEO_INFO_FORMAT(info), GST_VIDEO_INFO_WIDTH(info),
+				       GST_VIDEO_INFO_HEIGHT(info), GST_VIDEO_INFO_N_PLANES(info), info->offset,
+				       info->stride);
+
+	GST_BUFFER_PTS(entry->buffer) = pts;
+
+	g_queue_push_tail(&vaapi->lookahead_queue, entry);
+
+	lookahead_add(&vaapi->lookahead_qp, complexity);
+}
+
+// Mean complexity of the frames ahead, including the one to be encoded next
+static gdouble lookahead_complexity(obs_vaapi_t *vaapi)
+{
+	gdouble complexity = 0.0;
+
+	for (GList *elem = vaapi->lookahead_queue.head; elem != NULL; elem = elem->next) {
+		lookahead_frame_t *entry = elem->data;
+		complexity += entry->complexity;
+	}
+
+	return complexity / g_queue_get_length(&vaapi->lookahead_queue);
+}
+
+// The QP offset goes to the VA encoders as a region of interest meta, as
+// they restart the sequence on QP property changes. Should an encoder or
+// driver still do that, every change would be an IDR. Watch the frame
+// after each change for a keyframe nobody asked for.
+static void check_qp_change(obs_vaapi_t *vaapi, struct encoder_packet *packet)
+{
+	bool cadence = vaapi->gop_frames && packet->pts - vaapi->last_keyframe_pts >= vaapi->gop_frames;
+
+	if (!packet->keyframe || vaapi->qp_change_keyframe || cadence) {
+		return;
+	}
+
+	blog(LOG_WARNING, "[obs-vaapi] lookahead: changing the QP restarted the sequence, QP adjustment disabled");
+	lookahead_disable(&vaapi->lookahead_qp, vaapi->vaapiencoder);
+}
+
 static int scanfilter(const struct dirent *entry)
 {
 	return g_str_has_suffix(entry->d_name, "-render");
@@ -172,15 +816,63 @@ static const char *get_name(void *type_data)
 	return name;
 }
 
+static void destroy(void *data);
+
 static void *create(obs_data_t *settings, obs_encoder_t *encoder)
 {
 	obs_vaapi_t *vaapi = bzalloc(sizeof(obs_vaapi_t));
 
 	vaapi->encoder = encoder;
+	g_mutex_init(&vaapi->mutex);
+	g_cond_init(&vaapi->cond);
+	vaapi->low_latency = obs_data_get_bool(settings, "low-latency-mode");
+	vaapi->latency_budget = obs_data_get_int(settings, "latency-budget") * GST_MSECOND;
+	vaapi->keyframes.interval = obs_data_get_int(settings, "keyframe-request-interval") * G_TIME_SPAN_MILLISECOND;
+	vaapi->drop_frames = obs_data_get_bool(settings, "drop-frames-on-overload");
+	vaapi->scene_detect = obs_data_get_bool(settings, "scene-cut-detection");
+	vaapi->scene_threshold = obs_data_get_double(settings, "scene-cut-threshold");
+	vaapi->lookahead = obs_data_get_int(settings, "lookahead");
+
+	if (vaapi->low_latency && vaapi->lookahead) {
+		blog(LOG_WARNING, "[obs-vaapi] lookahead: disabled in low-latency mode");
+		vaapi->lookahead = 0;
+	}
+
+	g_queue_init(&vaapi->lookahead_queue);
+
+	for (guint i = 0; i < G_N_ELEMENTS(vaapi->latency_pts); i++) {
+		vaapi->latency_pts[i] = GST_CLOCK_TIME_NONE;
+	}
+	vaapi->output_pts = GST_CLOCK_TIME_NONE;
+	vaapi->qp_change_pts = GST_CLOCK_TIME_NONE;
 
 	struct obs_video_info video_info;
 	obs_get_video_info(&video_info);
 
+	vaapi->buffer_size = get_buffer_size(video_info.output_format, obs_encoder_get_width(encoder),
+					     obs_encoder_get_height(encoder));
+	vaapi->drop.frame_duration = (gdouble)G_USEC_PER_SEC * video_info.fps_den / video_info.fps_num;
+
+	if (vaapi->scene_detect || vaapi->lookahead) {
+		switch (video_info.output_format) {
+		case VIDEO_FORMAT_I420:
+		case VIDEO_FORMAT_NV12:
+		case VIDEO_FORMAT_I444:
+			vaapi->scene_min_frames = obs_data_get_int(settings, "scene-cut-min-interval") *
+						  video_info.fps_num / (video_info.fps_den * 1000);
+			vaapi->analysis =
+				analysis_create(obs_encoder_get_width(encoder), obs_encoder_get_height(encoder));
+			gst_video_info_set_format(&vaapi->lookahead_info, map_video_format(video_info.output_format),
+						  obs_encoder_get_width(encoder), obs_encoder_get_height(encoder));
+			break;
+		default:
+			blog(LOG_WARNING, "[obs-vaapi] scene-cut detection and lookahead need 8-bit YUV, disabled");
+			vaapi->scene_detect = false;
+			vaapi->lookahead = 0;
+			break;
+		}
+	}
+
 	GstCaps *caps = gst_caps_new_simple("video/x-raw", "framerate", GST_TYPE_FRACTION, video_info.fps_num,
 					    video_info.fps_den, "width", G_TYPE_INT, obs_encoder_get_width(encoder),
 					    "height", G_TYPE_INT, obs_encoder_get_height(encoder), "interlace-mode",
@@ -218,12 +910,21 @@ static void *create(obs_data_t *settings, obs_encoder_t *encoder)
 
 	gst_util_set_object_arg(G_OBJECT(vaapi->appsrc), "format", "time");
 
+	// The default queue limit is smaller than a single raw frame.
+	// As encode() waits for every frame to be consumed, there is
+	// never more than one in the queue.
+	g_object_set(vaapi->appsrc, "max-bytes", (guint64)vaapi->buffer_size * 2, NULL);
+
 	// Should never trigger as we block the encode function
 	// until the current buffer has been consumed. If we
 	// block for too long it should be reported as encoder
 	// overload in OBS.
 	g_signal_connect(vaapi->appsrc, "enough-data", G_CALLBACK(enough_data), NULL);
 
+	// The appsink queue stays unbounded. encode() is its only reader and
+	// waits for the input buffer to be consumed. A blocking appsink would
+	// stall the streaming thread and thereby encode().
+
 	g_object_set(vaapi->appsink, "sync", FALSE, NULL);
 
 	GstVideoColorimetry cinfo;
@@ -263,62 +964,31 @@ static void *create(obs_data_t *settings, obs_encoder_t *encoder)
 	g_object_set(vaapi->appsrc, "caps", caps, NULL);
 	gst_caps_unref(caps);
 
-	GstElement *vaapipostproc = NULL;
-	GstElement *vaapiencoder = NULL;
-	GstElement *parser = NULL;
-
-	if (g_str_has_prefix(obs_encoder_get_id(encoder), "obs-va-")) {
-		gchar **fields = g_regex_split_simple("obs-va-va(renderD\\d+)?.*", obs_encoder_get_id(encoder), 0, 0);
-
-		gchar *tmp = g_strdup_printf("va%spostproc", fields[1]);
-		g_strfreev(fields);
-
-		vaapipostproc = gst_element_factory_make(tmp, NULL);
-		g_free(tmp);
-
-		gst_util_set_object_arg(G_OBJECT(vaapipostproc), "scale-method", "hq");
-
-		vaapiencoder = gst_element_factory_make(obs_encoder_get_id(encoder) + strlen("obs-va-"), NULL);
-	} else if (g_str_has_prefix(obs_encoder_get_id(encoder), "obs-vaapi-")) {
-		g_setenv("GST_VAAPI_DRM_DEVICE", obs_data_get_string(settings, "device"), TRUE);
-
-		vaapipostproc = gst_element_factory_make("vaapipostproc", NULL);
-		vaapiencoder = gst_element_factory_make(obs_encoder_get_id(encoder) + strlen("obs-vaapi-"), NULL);
-	}
-
-	if (g_strcmp0(obs_encoder_get_codec(encoder), "h264") == 0) {
-		parser = gst_element_factory_make("h264parse", NULL);
-
-		caps = gst_caps_new_simple("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
-					   G_TYPE_STRING, "au", NULL);
-
-		g_object_set(vaapi->appsink, "caps", caps, NULL);
-		gst_caps_unref(caps);
-	} else if (g_strcmp0(obs_encoder_get_codec(encoder), "hevc") == 0) {
-		parser = gst_element_factory_make("h265parse", NULL);
-
-		caps = gst_caps_new_simple("video/x-h265", "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
-					   G_TYPE_STRING, "au", NULL);
-
-		g_object_set(vaapi->appsink, "caps", caps, NULL);
-		gst_caps_unref(caps);
-	} else {
-		parser = gst_element_factory_make("av1parse", NULL);
+	GstElement *vaapiencoder = NULL;
 
-		caps = gst_caps_new_simple("video/x-av1", "stream-format", G_TYPE_STRING, "obu-stream", "alignment",
-					   G_TYPE_STRING, "tu", NULL);
+	if (g_str_has_prefix(obs_encoder_get_id(encoder), "obs-va-")) {
+		vaapiencoder = gst_element_factory_make(obs_encoder_get_id(encoder) + strlen("obs-va-"), NULL);
+	} else if (g_str_has_prefix(obs_encoder_get_id(encoder), "obs-vaapi-")) {
+		g_setenv("GST_VAAPI_DRM_DEVICE", obs_data_get_string(settings, "device"), TRUE);
 
-		g_object_set(vaapi->appsink, "caps", caps, NULL);
-		gst_caps_unref(caps);
+		vaapiencoder = gst_element_factory_make(obs_encoder_get_id(encoder) + strlen("obs-vaapi-"), NULL);
 	}
 
-	gst_bin_add_many(GST_BIN(vaapi->pipe), vaapi->appsrc, vaapipostproc, vaapiencoder, parser, vaapi->appsink,
-			 NULL);
-	gst_element_link_many(vaapi->appsrc, vaapipostproc, vaapiencoder, parser, vaapi->appsink, NULL);
+	caps = pipeline_get_packet_caps(obs_encoder_get_codec(encoder));
+	g_object_set(vaapi->appsink, "caps", caps, NULL);
+	gst_caps_unref(caps);
+
+	vaapi->vaapiencoder = vaapiencoder;
 
 	obs_properties_t *properties = obs_encoder_properties(encoder);
 	for (obs_property_t *property = obs_properties_first(properties); property; obs_property_next(&property)) {
 		const char *name = obs_property_name(property);
+
+		// Skip our own settings
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(vaapiencoder), name) == NULL) {
+			continue;
+		}
+
 		switch (obs_property_get_type(property)) {
 		case OBS_PROPERTY_TEXT:
 			gst_util_set_object_arg(G_OBJECT(vaapiencoder), name, obs_data_get_string(settings, name));
@@ -347,18 +1017,151 @@ static void *create(obs_data_t *settings, obs_encoder_t *encoder)
 	}
 	obs_properties_destroy(properties);
 
+	if (vaapi->low_latency) {
+		gchar *set = pipeline_configure_low_latency(vaapiencoder);
+		blog(LOG_INFO, "[obs-vaapi] low-latency: %s", set);
+		g_free(set);
+	}
+
+	if (vaapi->lookahead) {
+		if (lookahead_setup(&vaapi->lookahead_qp, vaapiencoder)) {
+			blog(LOG_INFO, "[obs-vaapi] lookahead: %u frames, QP offset by %s", vaapi->lookahead,
+			     vaapi->lookahead_qp.roi ? "region of interest meta" : "property");
+		} else {
+			// Bitrate changes at runtime make the VA encoders
+			// restart the sequence, only QP is adjusted.
+			blog(LOG_WARNING, "[obs-vaapi] lookahead: needs rate-control cqp, disabled");
+			vaapi->lookahead = 0;
+
+			if (!vaapi->scene_detect) {
+				analysis_destroy(vaapi->analysis);
+				vaapi->analysis = NULL;
+			}
+		}
+	}
+
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(vaapiencoder), "key-int-max")) {
+		g_object_get(vaapiencoder, "key-int-max", &vaapi->gop_frames, NULL);
+	} else if (g_object_class_find_property(G_OBJECT_GET_CLASS(vaapiencoder), "keyframe-period")) {
+		g_object_get(vaapiencoder, "keyframe-period", &vaapi->gop_frames, NULL);
+	}
+
+	// Encoder settings like the profile may restrict the input caps,
+	// so only build the pipeline now.
+	pipeline_builder_t builder = {0};
+
+	pipeline_builder_add(&builder, vaapi->appsrc, "raw frames from OBS");
+
+	GstCaps *input_caps = gst_app_src_get_caps(GST_APP_SRC(vaapi->appsrc));
+	postproc_decision_t decision = pipeline_builder_add_encoder(
+		&builder, input_caps, vaapiencoder, obs_encoder_get_codec(encoder),
+		obs_data_get_string(settings, "postproc"), obs_data_get_string(settings, "postproc-quality"));
+	gst_caps_unref(input_caps);
+
+	if (!decision.postproc) {
+		blog(LOG_INFO, "[obs-vaapi] pipeline: no postproc, %s", decision.reason);
+	}
+
+	if (obs_data_get_bool(settings, "backup-recording")) {
+		vaapi->backup_bin = create_backup_bin(vaapi, settings);
+	}
+
+	GstElement *tee = NULL;
+
+	if (vaapi->backup_bin) {
+		tee = gst_element_factory_make("tee", NULL);
+		pipeline_builder_add(&builder, tee, "backup recording");
+	}
+
+	pipeline_builder_add(&builder, vaapi->appsink, "packets to OBS");
+	gchar *graph = NULL;
+	GError *err = NULL;
+
+	if (!pipeline_builder_build(&builder, GST_BIN(vaapi->pipe), &graph, &err)) {
+		blog(LOG_ERROR, "[obs-vaapi] pipeline: %s: %s", err->message, graph);
+		g_error_free(err);
+		g_free(graph);
+
+		// Not in the pipeline yet, nothing for it to finish
+		if (vaapi->backup_bin) {
+			gst_object_unref(gst_object_ref_sink(vaapi->backup_bin));
+			vaapi->backup_bin = NULL;
+		}
+
+		destroy(vaapi);
+		return NULL;
+	}
+
+	blog(LOG_INFO, "[obs-vaapi] pipeline: %s", graph);
+	g_free(graph);
+
+	// Started separately, a backup that fails to start must not keep
+	// the encoder from running
+	if (vaapi->backup_bin) {
+		gst_element_set_locked_state(vaapi->backup_bin, TRUE);
+		gst_bin_add(GST_BIN(vaapi->pipe), vaapi->backup_bin);
+		gst_element_link(tee, vaapi->backup_bin);
+	}
+
+	if (obs_data_get_bool(settings, "trace-capture")) {
+		vaapi->trace_settings = settings;
+		obs_data_addref(settings);
+	}
+
+	if (vaapi->low_latency) {
+		GstPad *pad = gst_element_get_static_pad(vaapi->appsink, "sink");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, latency_probe, vaapi, NULL);
+		gst_object_unref(pad);
+	}
+
 	GstBus *bus = gst_element_get_bus(vaapi->pipe);
 	gst_bus_add_watch(bus, bus_callback, NULL);
+	if (vaapi->backup_bin) {
+		gst_bus_set_sync_handler(bus, bus_sync_handler, vaapi, NULL);
+	}
 	gst_object_unref(bus);
 
 	blog(LOG_INFO, "[obs-vaapi] codec: %s, %dx%d@%d/%d, format: %s ", obs_encoder_get_id(encoder),
 	     obs_encoder_get_width(encoder), obs_encoder_get_height(encoder), video_info.fps_num, video_info.fps_den,
 	     gst_video_format_to_string(map_video_format(video_info.output_format)));
 
-	gst_element_set_state(vaapi->pipe, GST_STATE_PLAYING);
+	if (gst_element_set_state(vaapi->pipe, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+		blog(LOG_ERROR, "[obs-vaapi] pipeline failed to start");
 
-	g_mutex_init(&vaapi->mutex);
-	g_cond_init(&vaapi->cond);
+		// Nothing for the backup to finish
+		g_atomic_int_set(&vaapi->backup_failed, TRUE);
+		destroy(vaapi);
+		return NULL;
+	}
+
+	if (vaapi->backup_bin) {
+		gst_element_set_locked_state(vaapi->backup_bin, FALSE);
+
+		if (!gst_element_sync_state_with_parent(vaapi->backup_bin)) {
+			blog(LOG_ERROR, "[obs-vaapi] backup recording failed to start, stopped");
+			remove_backup_bin(vaapi);
+		}
+	}
+
+	// The OBS encoder may get restarted, only add the proc handler once.
+	// It is a no-op as long as we are not in the instances table.
+	g_mutex_lock(&instances_mutex);
+	bool has_proc_handler =
+		obs_weak_encoder_references_encoder(g_hash_table_lookup(proc_handlers, encoder), encoder);
+	if (!has_proc_handler) {
+		g_hash_table_insert(proc_handlers, encoder, obs_encoder_get_weak_encoder(encoder));
+	}
+	g_mutex_unlock(&instances_mutex);
+
+	// Not under instances_mutex, which the handler takes
+	if (!has_proc_handler) {
+		proc_handler_add(obs_encoder_get_proc_handler(encoder), "void request_keyframe()", request_keyframe_proc,
+				 encoder);
+	}
+
+	g_mutex_lock(&instances_mutex);
+	g_hash_table_insert(instances, encoder, vaapi);
+	g_mutex_unlock(&instances_mutex);
 
 	return vaapi;
 }
@@ -367,11 +1170,28 @@ static void destroy(void *data)
 {
 	obs_vaapi_t *vaapi = data;
 
-	if (vaapi->pipe) {
-		gst_element_set_state(vaapi->pipe, GST_STATE_NULL);
+	g_mutex_lock(&instances_mutex);
+	g_hash_table_remove(instances, vaapi->encoder);
+	g_mutex_unlock(&instances_mutex);
 
+	if (vaapi->pipe) {
 		GstBus *bus = gst_element_get_bus(vaapi->pipe);
 		gst_bus_remove_watch(bus);
+
+		// Let the muxer finish the last segment, unless it's gone
+		if (vaapi->backup_bin && !g_atomic_int_get(&vaapi->backup_failed)) {
+			gst_app_src_end_of_stream(GST_APP_SRC(vaapi->appsrc));
+
+			GstMessage *message =
+				gst_bus_timed_pop_filtered(bus, 2 * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+			if (message) {
+				gst_message_unref(message);
+			}
+		}
+
+		gst_element_set_state(vaapi->pipe, GST_STATE_NULL);
+
+		gst_bus_set_sync_handler(bus, NULL, NULL, NULL);
 		gst_object_unref(bus);
 
 		gst_object_unref(vaapi->pipe);
@@ -383,9 +1203,55 @@ static void destroy(void *data)
 		gst_sample_unref(vaapi->sample);
 	}
 
+	// Frames still in the lookahead are lost, OBS doesn't drain video encoders
+	lookahead_frame_t *entry;
+	while ((entry = g_queue_pop_head(&vaapi->lookahead_queue)) != NULL) {
+		gst_buffer_unref(entry->buffer);
+	}
+
 	g_mutex_clear(&vaapi->mutex);
 	g_cond_clear(&vaapi->cond);
 
+	if (vaapi->backup_dropped || vaapi->backup_overruns) {
+		blog(LOG_INFO,
+		     "[obs-vaapi] backup recording: %" G_GUINT64_FORMAT " buffers dropped, %d queue overruns",
+		     vaapi->backup_dropped, vaapi->backup_overruns);
+	}
+
+	if (vaapi->qp_changes) {
+		blog(LOG_INFO, "[obs-vaapi] lookahead: %" G_GUINT64_FORMAT " QP changes", vaapi->qp_changes);
+	}
+
+	if (vaapi->frames_dropped) {
+		blog(LOG_INFO, "[obs-vaapi] dropped %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames",
+		     vaapi->frames_dropped, vaapi->frames);
+	}
+
+	// Cost in the field, bench-analysis measures the detector in isolation
+	if (vaapi->analysis_frames) {
+		blog(LOG_INFO, "[obs-vaapi] frame analysis: %.3f ms per frame, %" G_GUINT64_FORMAT " scene cuts",
+		     vaapi->analysis_time / 1000.0 / vaapi->analysis_frames, vaapi->scene_cuts);
+	}
+
+	if (vaapi->analysis) {
+		analysis_destroy(vaapi->analysis);
+	}
+
+	if (vaapi->trace_settings) {
+		obs_data_release(vaapi->trace_settings);
+	}
+
+	if (vaapi->trace) {
+		blog(LOG_INFO, "[obs-vaapi] trace: %" G_GUINT64_FORMAT " frames captured, %" G_GUINT64_FORMAT " skipped",
+		     (guint64)trace_get_frame_count(vaapi->trace), vaapi->trace_skipped);
+		trace_close(vaapi->trace);
+	}
+
+	if (vaapi->late_frames) {
+		blog(LOG_INFO, "[obs-vaapi] low-latency: %" G_GUINT64_FORMAT " frames missed the latency budget",
+		     vaapi->late_frames);
+	}
+
 	bfree(vaapi->codec_data);
 	bfree(vaapi);
 }
@@ -395,10 +1261,63 @@ static void destroy_notify(void *data)
 	obs_vaapi_t *vaapi = data;
 
 	g_mutex_lock(&vaapi->mutex);
+	vaapi->consumed = true;
 	g_cond_signal(&vaapi->cond);
 	g_mutex_unlock(&vaapi->mutex);
 }
 
+static bool output_packet(obs_vaapi_t *vaapi, struct encoder_packet *packet, bool *received_packet)
+{
+	if (vaapi->sample == NULL) {
+		return true;
+	}
+
+	// Encoders only report their latency after caps negotiation,
+	// so check the budget once the first packet came out.
+	if (vaapi->low_latency && !vaapi->latency_checked) {
+		check_latency(vaapi);
+		vaapi->latency_checked = true;
+	}
+
+	*received_packet = true;
+
+	GstBuffer *buffer = gst_sample_get_buffer(vaapi->sample);
+
+	gst_buffer_map(buffer, &vaapi->info, GST_MAP_READ);
+
+	if (vaapi->codec_data == NULL) {
+		vaapi->codec_data = bmemdup(vaapi->info.data, vaapi->info.size);
+		vaapi->codec_size = vaapi->info.size;
+	}
+
+	packet->data = vaapi->info.data;
+	packet->size = vaapi->info.size;
+
+	packet->pts = GST_BUFFER_PTS(buffer);
+	packet->dts = GST_BUFFER_DTS(buffer);
+
+	packet->pts /= GST_SECOND / (packet->timebase_den / packet->timebase_num);
+	packet->dts /= GST_SECOND / (packet->timebase_den / packet->timebase_num);
+
+	packet->type = OBS_ENCODER_VIDEO;
+
+	packet->keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+	if (GST_CLOCK_TIME_IS_VALID(vaapi->qp_change_pts) && GST_BUFFER_PTS(buffer) == vaapi->qp_change_pts) {
+		check_qp_change(vaapi, packet);
+		vaapi->qp_change_pts = GST_CLOCK_TIME_NONE;
+	}
+
+	if (packet->keyframe) {
+		keyframe_done(vaapi);
+
+		vaapi->last_keyframe_pts = packet->pts;
+		vaapi->dropped_since_keyframe = 0;
+	}
+
+	return true;
+}
+
 static bool encode(void *data, struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet)
 {
 	obs_vaapi_t *vaapi = data;
@@ -410,96 +1329,173 @@ static bool encode(void *data, struct encoder_frame *frame, struct encoder_packe
 		vaapi->sample = NULL;
 	}
 
-	struct obs_video_info video_info;
-	obs_get_video_info(&video_info);
+	vaapi->frames++;
 
-	GstVideoFormat format = GST_VIDEO_FORMAT_UNKNOWN;
-	gsize buffer_size = 0;
+	if (vaapi->trace_settings) {
+		vaapi->trace = create_trace(vaapi, frame);
+		obs_data_release(vaapi->trace_settings);
+		vaapi->trace_settings = NULL;
+	}
 
-	switch (video_info.output_format) {
-	case VIDEO_FORMAT_I420:
-		format = GST_VIDEO_FORMAT_I420;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 3 / 2;
-		break;
-	case VIDEO_FORMAT_NV12:
-		format = GST_VIDEO_FORMAT_NV12;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 3 / 2;
-		break;
-	case VIDEO_FORMAT_I444:
-		format = GST_VIDEO_FORMAT_Y444;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 3;
-		break;
-	case VIDEO_FORMAT_BGRA:
-		format = GST_VIDEO_FORMAT_BGRx;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 4;
-		break;
-	case VIDEO_FORMAT_P010:
-		format = GST_VIDEO_FORMAT_P010_10LE;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 3;
-		break;
-	case VIDEO_FORMAT_I010:
-		format = GST_VIDEO_FORMAT_I420_10LE;
-		buffer_size = obs_encoder_get_width(vaapi->encoder) * obs_encoder_get_height(vaapi->encoder) * 3;
-		break;
-	default:
-		break;
+	if (vaapi->trace && !trace_write(vaapi->trace, frame->pts, g_get_monotonic_time(), frame->data,
+					 frame->linesize)) {
+		if (vaapi->trace_skipped++ == 0) {
+			blog(LOG_WARNING, "[obs-vaapi] trace: frame layout changed, skipping frames that don't fit");
+		}
+	}
+
+	gdouble temporal = 0.0;
+	gdouble spatial = 0.0;
+
+	if (vaapi->analysis != NULL) {
+		analyze_frame(vaapi, frame, &temporal, &spatial);
 	}
 
-	GstBuffer *buffer =
-		gst_buffer_new_wrapped_full(0, frame->data[0], buffer_size, 0, buffer_size, vaapi, destroy_notify);
+	bool scene_cut = vaapi->scene_detect && detect_scene_cut(vaapi, frame, temporal);
+	bool force_keyframe = scene_cut;
 
-	GstVideoMeta *meta = gst_buffer_add_video_meta(buffer, 0, format, obs_encoder_get_width(vaapi->encoder),
-						       obs_encoder_get_height(vaapi->encoder));
+	if (vaapi->drop_frames && !scene_cut) {
+		if (drop_frame(vaapi)) {
+			// Still hand out what the encoder has finished meanwhile
+			vaapi->sample = gst_app_sink_try_pull_sample(GST_APP_SINK(vaapi->appsink), 0);
+			return output_packet(vaapi, packet, received_packet);
+		}
 
-	for (int i = 0; frame->linesize[i]; i++) {
-		meta->stride[i] = frame->linesize[i];
+		// Dropped frames push the encoder's frame counted keyframes
+		// back in time. Keep the keyframe cadence by forcing one.
+		if (vaapi->dropped_since_keyframe && vaapi->gop_frames &&
+		    frame->pts - vaapi->last_keyframe_pts >= vaapi->gop_frames) {
+			force_keyframe = true;
+			vaapi->dropped_since_keyframe = 0;
+		}
 	}
 
-	GST_BUFFER_PTS(buffer) = frame->pts * (GST_SECOND / (packet->timebase_den / packet->timebase_num));
+	struct obs_video_info video_info;
+	obs_get_video_info(&video_info);
 
-	g_mutex_lock(&vaapi->mutex);
+	GstVideoFormat format = map_video_format(video_info.output_format);
+	GstClockTime pts = frame->pts * (GST_SECOND / (packet->timebase_den / packet->timebase_num));
+	GstBuffer *buffer = NULL;
+	bool qp_changed = false;
 
-	gst_app_src_push_buffer(GST_APP_SRC(vaapi->appsrc), buffer);
+	if (vaapi->lookahead) {
+		lookahead_push(vaapi, frame, pts, temporal + spatial, force_keyframe);
 
-	g_cond_wait(&vaapi->cond, &vaapi->mutex);
-	g_mutex_unlock(&vaapi->mutex);
+		if (g_queue_get_length(&vaapi->lookahead_queue) <= vaapi->lookahead) {
+			vaapi->sample = gst_app_sink_try_pull_sample(GST_APP_SINK(vaapi->appsink), 0);
+			return output_packet(vaapi, packet, received_packet);
+		}
 
-	vaapi->sample = gst_app_sink_try_pull_sample(GST_APP_SINK(vaapi->appsink), 0);
-	if (vaapi->sample == NULL) {
-		return true;
+		// Set the QP while no frame is in flight
+		qp_changed = lookahead_update(&vaapi->lookahead_qp, vaapi->vaapiencoder, lookahead_complexity(vaapi));
+
+		lookahead_frame_t *entry = g_queue_pop_head(&vaapi->lookahead_queue);
+		buffer = entry->buffer;
+		force_keyframe = entry->force_keyframe;
+
+		lookahead_apply(&vaapi->lookahead_qp, buffer, GST_VIDEO_INFO_WIDTH(&vaapi->lookahead_info),
+				GST_VIDEO_INFO_HEIGHT(&vaapi->lookahead_info));
+	} else {
+		buffer = gst_buffer_new_wrapped_full(0, frame->data[0], vaapi->buffer_size, 0, vaapi->buffer_size,
+						     vaapi, destroy_notify);
+		GST_BUFFER_PTS(buffer) = pts;
+
+		GstVideoMeta *meta = gst_buffer_add_video_meta(buffer, 0, format, obs_encoder_get_width(vaapi->encoder),
+							       obs_encoder_get_height(vaapi->encoder));
+
+		for (int i = 0; frame->linesize[i]; i++) {
+			meta->stride[i] = frame->linesize[i];
+		}
 	}
 
-	*received_packet = true;
+	gint64 start = g_get_monotonic_time();
+	GstClockTime buffer_pts = GST_BUFFER_PTS(buffer);
 
-	buffer = gst_sample_get_buffer(vaapi->sample);
+	g_mutex_lock(&vaapi->mutex);
 
-	gst_buffer_map(buffer, &vaapi->info, GST_MAP_READ);
+	if (qp_changed) {
+		vaapi->qp_change_pts = buffer_pts;
+		vaapi->qp_change_keyframe = force_keyframe || vaapi->keyframes.request_time != 0;
+		vaapi->qp_changes++;
+	}
 
-	if (vaapi->codec_data == NULL) {
-		vaapi->codec_data = bmemdup(vaapi->info.data, vaapi->info.size);
-		vaapi->codec_size = vaapi->info.size;
+	send_keyframe_request(vaapi, force_keyframe);
+
+	if (vaapi->low_latency) {
+		guint slot = vaapi->latency_slot++ % G_N_ELEMENTS(vaapi->latency_pts);
+
+		vaapi->latency_pts[slot] = buffer_pts;
+		vaapi->latency_push_time[slot] = start;
 	}
 
-	packet->data = vaapi->info.data;
-	packet->size = vaapi->info.size;
+	vaapi->consumed = false;
 
-	packet->pts = GST_BUFFER_PTS(buffer);
-	packet->dts = GST_BUFFER_DTS(buffer);
+	gst_app_src_push_buffer(GST_APP_SRC(vaapi->appsrc), buffer);
 
-	packet->pts /= GST_SECOND / (packet->timebase_den / packet->timebase_num);
-	packet->dts /= GST_SECOND / (packet->timebase_den / packet->timebase_num);
+	// The latency probe signals the same condition
+	while (!vaapi->consumed) {
+		g_cond_wait(&vaapi->cond, &vaapi->mutex);
+	}
+	g_mutex_unlock(&vaapi->mutex);
 
-	packet->type = OBS_ENCODER_VIDEO;
+	// The frame is released once the streaming thread copied it into a
+	// postproc or encoder surface, which is after the previous frame went
+	// through the encoder. When the encoder can't keep up, OBS calls us
+	// back to back and this is the pipeline's time per frame. Otherwise
+	// it's little more than the copy.
+	drop_add_encode_time(&vaapi->drop, g_get_monotonic_time() - start);
+
+	if (vaapi->low_latency) {
+		// Give the packet of this very frame what is left of the budget.
+		// Once the encoder is behind, waiting would only hold up OBS on
+		// every frame. latency_probe() keeps measuring either way.
+		gint64 deadline = start + vaapi->latency_budget / GST_USECOND;
+
+		g_mutex_lock(&vaapi->mutex);
+		while (!vaapi->latency_behind &&
+		       (!GST_CLOCK_TIME_IS_VALID(vaapi->output_pts) || vaapi->output_pts < buffer_pts)) {
+			if (!g_cond_wait_until(&vaapi->cond, &vaapi->mutex, deadline)) {
+				vaapi->latency_behind = true;
+			}
+		}
+		g_mutex_unlock(&vaapi->mutex);
+	}
 
-	packet->keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	vaapi->sample = gst_app_sink_try_pull_sample(GST_APP_SINK(vaapi->appsink), 0);
 
-	return true;
+	return output_packet(vaapi, packet, received_packet);
+}
+
+static void get_plugin_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_bool(settings, "low-latency-mode", false);
+	obs_data_set_default_int(settings, "latency-budget", 50);
+	obs_data_set_default_int(settings, "keyframe-request-interval", 1000);
+	obs_data_set_default_bool(settings, "drop-frames-on-overload", false);
+	obs_data_set_default_bool(settings, "scene-cut-detection", false);
+	obs_data_set_default_double(settings, "scene-cut-threshold", 30.0);
+	obs_data_set_default_int(settings, "scene-cut-min-interval", 500);
+	obs_data_set_default_int(settings, "lookahead", 0);
+	obs_data_set_default_bool(settings, "backup-recording", false);
+	obs_data_set_default_string(settings, "backup-path", g_get_home_dir());
+	obs_data_set_default_string(settings, "backup-format", "mpegts");
+	obs_data_set_default_int(settings, "backup-segment-duration", 0);
+	obs_data_set_default_bool(settings, "trace-capture", false);
+	gchar *trace_path = g_build_filename(g_get_user_cache_dir(), "obs-vaapi", NULL);
+	obs_data_set_default_string(settings, "trace-path", trace_path);
+	g_free(trace_path);
+	obs_data_set_default_int(settings, "trace-duration", 10);
+	obs_data_set_default_string(settings, "postproc", "auto");
+	obs_data_set_default_string(settings, "postproc-quality", "hq");
+	obs_data_set_default_string(settings, "tuned-preset", "");
 }
 
 static void get_defaults2(obs_data_t *settings, void *type_data)
 {
 	GstElement *encoder = NULL;
 
+	get_plugin_defaults(settings);
+
 	if (g_str_has_prefix(type_data, "obs-va-")) {
 		encoder = gst_element_factory_make(type_data + strlen("obs-va-"), NULL);
 	} else if (g_str_has_prefix(type_data, "obs-vaapi-")) {
@@ -636,6 +1632,202 @@ static void populate_devices(obs_property_t *prop)
 	free(list);
 }
 
+static void get_plugin_properties(obs_properties_t *properties)
+{
+	obs_property_t *property = NULL;
+
+	property = obs_properties_add_bool(properties, "low-latency-mode", "low-latency-mode");
+	obs_property_set_long_description(
+		property, "Enforce one packet per frame: no B-frames, single reference frame, no encoder lookahead");
+
+	property = obs_properties_add_int(properties, "latency-budget", "latency-budget", 1, 1000, 1);
+	obs_property_int_set_suffix(property, " ms");
+	obs_property_set_long_description(property, "Maximum encoder latency in low-latency mode");
+
+	property = obs_properties_add_int(properties, "keyframe-request-interval", "keyframe-request-interval", 0,
+					  10000, 100);
+	obs_property_int_set_suffix(property, " ms");
+	obs_property_set_long_description(property,
+					  "Minimum time between keyframes forced by the request_keyframe proc handler");
+
+	property = obs_properties_add_bool(properties, "drop-frames-on-overload", "drop-frames-on-overload");
+	obs_property_set_long_description(
+		property, "Drop frames evenly when the encoder falls behind instead of stalling the video thread");
+
+	property = obs_properties_add_bool(properties, "scene-cut-detection", "scene-cut-detection");
+	obs_property_set_long_description(
+		property, "Force keyframes on scene cuts. Allows a longer keyframe interval on the encoder otherwise");
+
+	property = obs_properties_add_float(properties, "scene-cut-threshold", "scene-cut-threshold", 1.0, 255.0, 0.5);
+	obs_property_set_long_description(property, "Mean luma difference between frames that counts as a scene cut");
+
+	property =
+		obs_properties_add_int(properties, "scene-cut-min-interval", "scene-cut-min-interval", 0, 10000, 100);
+	obs_property_int_set_suffix(property, " ms");
+	obs_property_set_long_description(property, "Minimum time between keyframes placed on scene cuts");
+
+	property = obs_properties_add_int(properties, "lookahead", "lookahead", 0, 60, 1);
+	obs_property_int_set_suffix(property, " frames");
+	obs_property_set_long_description(
+		property, "Delay frames to adapt the QP to upcoming content (rate-control cqp, for recordings)");
+
+	property = obs_properties_add_bool(properties, "backup-recording", "backup-recording");
+	obs_property_set_long_description(property, "Write the encoded stream to disk as well, without encoding twice");
+
+	property = obs_properties_add_path(properties, "backup-path", "backup-path", OBS_PATH_DIRECTORY, NULL, NULL);
+	obs_property_set_long_description(property, "Directory for the backup recording");
+
+	property = obs_properties_add_list(properties, "backup-format", "backup-format", OBS_COMBO_TYPE_LIST,
+					   OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(property, "MPEG-TS", "mpegts");
+	obs_property_list_add_string(property, "Fragmented MP4", "mp4");
+	obs_property_set_long_description(property, "Container of the backup recording");
+
+	property = obs_properties_add_int(properties, "backup-segment-duration", "backup-segment-duration", 0, 86400,
+					  1);
+	obs_property_int_set_suffix(property, " s");
+	obs_property_set_long_description(property, "Start a new backup file after this time, 0 for a single file");
+
+	property = obs_properties_add_bool(properties, "trace-capture", "trace-capture");
+	obs_property_set_long_description(property,
+					  "Keep the last raw input frames in a trace file for obs-vaapi-replay");
+
+	property = obs_properties_add_path(properties, "trace-path", "trace-path", OBS_PATH_DIRECTORY, NULL, NULL);
+	obs_property_set_long_description(property, "Directory for the trace file, one file per encoder that is overwritten each session");
+
+	property = obs_properties_add_int(properties, "trace-duration", "trace-duration", 1, 600, 1);
+	obs_property_int_set_suffix(property, " s");
+	obs_property_set_long_description(property, "Length of the trace ring, takes one raw frame of disk per frame");
+
+	property = obs_properties_add_list(properties, "postproc", "postproc", OBS_COMBO_TYPE_LIST,
+					   OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(property, "Auto", "auto");
+	obs_property_list_add_string(property, "Always", "always");
+	obs_property_set_long_description(property, "Only add the postproc element when the encoder needs it");
+
+	property = obs_properties_add_list(properties, "postproc-quality", "postproc-quality", OBS_COMBO_TYPE_LIST,
+					   OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(property, "Fast", "fast");
+	obs_property_list_add_string(property, "Default", "default");
+	obs_property_list_add_string(property, "High Quality", "hq");
+	obs_property_set_long_description(property, "Scale method when the postproc element has to scale");
+}
+
+static const char *get_preset_element(const char *type_data)
+{
+	return g_str_has_prefix(type_data, "obs-va-") ? type_data + strlen("obs-va-")
+						      : type_data + strlen("obs-vaapi-");
+}
+
+// Depends on the OBS install, e.g. portable or Flatpak. Free with bfree().
+static char *get_presets_path(const char *type_data)
+{
+	gchar *filename = g_strdup_printf("presets/%s.ini", get_preset_element(type_data));
+	char *path = obs_module_config_path(filename);
+	g_free(filename);
+
+	return path;
+}
+
+// Presets written by obs-vaapi-tune, one group of encoder properties each
+static GKeyFile *load_presets(const char *type_data)
+{
+	char *path = get_presets_path(type_data);
+	GKeyFile *key_file = g_key_file_new();
+
+	if (path == NULL || !g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free(key_file);
+		key_file = NULL;
+	}
+
+	bfree(path);
+
+	return key_file;
+}
+
+static bool preset_modified(void *priv, obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
+{
+	const char *preset = obs_data_get_string(settings, "tuned-preset");
+
+	if (preset == NULL || *preset == '\0') {
+		return false;
+	}
+
+	GKeyFile *key_file = load_presets(priv);
+	gchar **keys = key_file ? g_key_file_get_keys(key_file, preset, NULL, NULL) : NULL;
+
+	for (gchar **key = keys; key && *key; key++) {
+		obs_property_t *target = obs_properties_get(props, *key);
+		gchar *value = g_key_file_get_string(key_file, preset, *key, NULL);
+
+		switch (target ? obs_property_get_type(target) : OBS_PROPERTY_INVALID) {
+		case OBS_PROPERTY_INT:
+			obs_data_set_int(settings, *key, g_ascii_strtoll(value, NULL, 10));
+			break;
+		case OBS_PROPERTY_FLOAT:
+			obs_data_set_double(settings, *key, g_ascii_strtod(value, NULL));
+			break;
+		case OBS_PROPERTY_BOOL:
+			obs_data_set_bool(settings, *key, g_ascii_strcasecmp(value, "true") == 0);
+			break;
+		case OBS_PROPERTY_LIST:
+		case OBS_PROPERTY_TEXT:
+			obs_data_set_string(settings, *key, value);
+			break;
+		default:
+			blog(LOG_WARNING, "[obs-vaapi] preset %s: unknown property %s", preset, *key);
+			break;
+		}
+
+		g_free(value);
+	}
+
+	blog(LOG_INFO, "[obs-vaapi] applied preset: %s", preset);
+
+	g_strfreev(keys);
+	if (key_file) {
+		g_key_file_free(key_file);
+	}
+
+	// A preset is applied once, later edits stay untouched
+	obs_data_set_string(settings, "tuned-preset", "");
+
+	return true;
+}
+
+static void add_preset_property(obs_properties_t *properties, const char *type_data)
+{
+	obs_property_t *property = obs_properties_add_list(properties, "tuned-preset", "tuned-preset",
+							   OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(property, "None", "");
+
+	char *path = get_presets_path(type_data);
+	const char *location = path ? path : "the obs-vaapi plugin config";
+	gchar *description;
+
+	GKeyFile *key_file = load_presets(type_data);
+	if (key_file) {
+		gchar **groups = g_key_file_get_groups(key_file, NULL);
+		for (gchar **group = groups; *group; group++) {
+			obs_property_list_add_string(property, *group, *group);
+		}
+		g_strfreev(groups);
+		g_key_file_free(key_file);
+
+		description = g_strdup_printf("Apply encoder settings found by obs-vaapi-tune, from %s", location);
+	} else {
+		blog(LOG_INFO, "[obs-vaapi] no presets in %s, run obs-vaapi-tune", location);
+
+		description = g_strdup_printf("No presets in %s, run obs-vaapi-tune --encoder %s --output %s", location,
+					      get_preset_element(type_data), location);
+	}
+	bfree(path);
+
+	obs_property_set_long_description(property, description);
+	g_free(description);
+	obs_property_set_modified_callback2(property, preset_modified, (void *)type_data);
+}
+
 static obs_properties_t *get_properties2(void *data, void *type_data)
 {
 	GstElement *encoder = NULL;
@@ -656,6 +1848,9 @@ static obs_properties_t *get_properties2(void *data, void *type_data)
 		obs_property_set_long_description(property, "Specify DRM device to use");
 	}
 
+	add_preset_property(properties, type_data);
+	get_plugin_properties(properties);
+
 	guint num_properties;
 	GParamSpec **property_specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(encoder), &num_properties);
 
@@ -780,6 +1975,8 @@ MODULE_EXPORT bool obs_module_load(void)
 	gst_init(NULL, NULL);
 
 	hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	instances = g_hash_table_new(NULL, NULL);
+	proc_handlers = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)obs_weak_encoder_release);
 
 	struct obs_encoder_info vaapi = {
 		.type = OBS_ENCODER_VIDEO,
@@ -853,5 +2050,7 @@ MODULE_EXPORT bool obs_module_load(void)
 
 MODULE_EXPORT void obs_module_unload(void)
 {
+	g_hash_table_unref(proc_handlers);
+	g_hash_table_unref(instances);
 	g_hash_table_unref(hash_table);
 }
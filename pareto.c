@@ -0,0 +1,66 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pareto.h"
+
+bool pareto_dominates(const pareto_point_t *a, const pareto_point_t *b)
+{
+	if (a->fps < b->fps || a->latency > b->latency || a->bitrate > b->bitrate || a->psnr < b->psnr) {
+		return false;
+	}
+
+	return a->fps > b->fps || a->latency < b->latency || a->bitrate < b->bitrate || a->psnr > b->psnr;
+}
+
+void pareto_find(pareto_point_t *points, guint count)
+{
+	for (guint i = 0; i < count; i++) {
+		points[i].pareto = !points[i].failed;
+
+		for (guint j = 0; j < count && points[i].pareto; j++) {
+			if (i != j && !points[j].failed && pareto_dominates(&points[j], &points[i])) {
+				points[i].pareto = false;
+			}
+		}
+	}
+}
+
+gchar *pareto_get_name(const pareto_point_t *points, guint count, guint index)
+{
+	const pareto_point_t *p = &points[index];
+	bool fastest = true;
+	bool latency = true;
+	bool smallest = true;
+	bool quality = true;
+
+	for (guint i = 0; i < count; i++) {
+		if (!points[i].pareto) {
+			continue;
+		}
+		fastest &= points[i].fps <= p->fps;
+		latency &= points[i].latency >= p->latency;
+		smallest &= points[i].bitrate >= p->bitrate;
+		quality &= points[i].psnr <= p->psnr;
+	}
+
+	return g_strdup_printf("Tuned %u%s%s%s%s", index, fastest ? ", fastest" : "",
+			       latency ? ", lowest latency" : "", smallest ? ", smallest" : "",
+			       quality ? ", best quality" : "");
+}
@@ -0,0 +1,46 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+
+// Selection of the presets obs-vaapi-tune writes. Only GLib in here, so it
+// can be unit tested without running an encoder.
+
+typedef struct {
+	bool failed;
+	gdouble fps;
+	gdouble latency;
+	gdouble bitrate;
+	gdouble psnr;
+	bool pareto;
+} pareto_point_t;
+
+// a is at least as good as b in every metric and better in one
+bool pareto_dominates(const pareto_point_t *a, const pareto_point_t *b);
+
+// Marks the points no other successful point dominates
+void pareto_find(pareto_point_t *points, guint count);
+
+// "Tuned <index>" plus the metrics the point is best at among the marked
+// ones, free with g_free()
+gchar *pareto_get_name(const pareto_point_t *points, guint count, guint index);
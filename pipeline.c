@@ -0,0 +1,328 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <gst/video/video.h>
+#include <string.h>
+
+// Caps with only the size, or everything but the size
+static GstCaps *split_caps(const GstCaps *caps, bool size)
+{
+	GstCaps *split = gst_caps_new_empty();
+
+	for (guint i = 0; i < gst_caps_get_size(caps); i++) {
+		const GstStructure *structure = gst_caps_get_structure(caps, i);
+
+		if (size) {
+			GstStructure *sizes = gst_structure_new_empty(gst_structure_get_name(structure));
+
+			if (gst_structure_has_field(structure, "width")) {
+				gst_structure_set_value(sizes, "width", gst_structure_get_value(structure, "width"));
+			}
+			if (gst_structure_has_field(structure, "height")) {
+				gst_structure_set_value(sizes, "height", gst_structure_get_value(structure, "height"));
+			}
+
+			gst_caps_append_structure(split, sizes);
+		} else {
+			GstStructure *copy = gst_structure_copy(structure);
+			gst_structure_remove_fields(copy, "width", "height", NULL);
+
+			gst_caps_append_structure_full(split, copy,
+						       gst_caps_features_copy(gst_caps_get_features(caps, i)));
+		}
+	}
+
+	return split;
+}
+
+static bool can_intersect_split(const GstCaps *a, const GstCaps *b, bool size)
+{
+	GstCaps *split_a = split_caps(a, size);
+	GstCaps *split_b = split_caps(b, size);
+
+	bool ret = gst_caps_can_intersect(split_a, split_b);
+
+	gst_caps_unref(split_b);
+	gst_caps_unref(split_a);
+
+	return ret;
+}
+
+postproc_decision_t pipeline_decide_postproc(const GstCaps *input_caps, const GstCaps *encoder_caps)
+{
+	postproc_decision_t decision = {false, false, "encoder accepts the raw frames"};
+
+	if (encoder_caps == NULL || gst_caps_is_empty(encoder_caps)) {
+		decision.postproc = true;
+		decision.reason = "encoder caps unknown";
+		return decision;
+	}
+
+	if (gst_caps_can_intersect(input_caps, encoder_caps)) {
+		return decision;
+	}
+
+	bool size_ok = can_intersect_split(input_caps, encoder_caps, true);
+	bool format_ok = can_intersect_split(input_caps, encoder_caps, false);
+
+	decision.postproc = true;
+	decision.scale = !size_ok;
+
+	if (!format_ok) {
+		decision.reason = "format or colorimetry not supported by the encoder";
+	} else if (!size_ok) {
+		decision.reason = "size not supported by the encoder";
+	} else {
+		decision.reason = "combination of format and size not supported by the encoder";
+	}
+
+	return decision;
+}
+
+GstCaps *pipeline_get_encoder_caps(GstElement *encoder)
+{
+	// In READY the encoders report what the device supports
+	// rather than their templates.
+	gst_element_set_state(encoder, GST_STATE_READY);
+
+	GstPad *pad = gst_element_get_static_pad(encoder, "sink");
+	GstCaps *caps = gst_pad_query_caps(pad, NULL);
+	gst_object_unref(pad);
+
+	return caps;
+}
+
+const char *pipeline_get_codec(const char *encoder_name)
+{
+	if (strstr(encoder_name, "264")) {
+		return "h264";
+	} else if (strstr(encoder_name, "265") || strstr(encoder_name, "hevc")) {
+		return "hevc";
+	} else {
+		return "av1";
+	}
+}
+
+GstElement *pipeline_make_postproc(const char *encoder_name)
+{
+	if (g_str_has_prefix(encoder_name, "vaapi")) {
+		return gst_element_factory_make("vaapipostproc", NULL);
+	} else if (g_str_has_prefix(encoder_name, "va")) {
+		gchar **fields = g_regex_split_simple("va(renderD\\d+)?.*", encoder_name, 0, 0);
+
+		gchar *name = g_strdup_printf("va%spostproc", fields[1]);
+		g_strfreev(fields);
+
+		GstElement *postproc = gst_element_factory_make(name, NULL);
+		g_free(name);
+
+		if (postproc) {
+			return postproc;
+		}
+	}
+
+	return gst_element_factory_make("videoconvert", NULL);
+}
+
+GstElement *pipeline_make_parser(const char *codec)
+{
+	return gst_element_factory_make(g_strcmp0(codec, "h264") == 0   ? "h264parse"
+					: g_strcmp0(codec, "hevc") == 0 ? "h265parse"
+									: "av1parse",
+					NULL);
+}
+
+GstCaps *pipeline_get_packet_caps(const char *codec)
+{
+	if (g_strcmp0(codec, "h264") == 0) {
+		return gst_caps_new_simple("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
+					   G_TYPE_STRING, "au", NULL);
+	} else if (g_strcmp0(codec, "hevc") == 0) {
+		return gst_caps_new_simple("video/x-h265", "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
+					   G_TYPE_STRING, "au", NULL);
+	} else {
+		return gst_caps_new_simple("video/x-av1", "stream-format", G_TYPE_STRING, "obu-stream", "alignment",
+					   G_TYPE_STRING, "tu", NULL);
+	}
+}
+
+static void set_property_if_exists(GstElement *element, const char *name, const char *value, GString *set)
+{
+	if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), name) == NULL) {
+		return;
+	}
+
+	gst_util_set_object_arg(G_OBJECT(element), name, value);
+	g_string_append_printf(set, "%s%s=%s", set->len ? ", " : "", name, value);
+}
+
+gchar *pipeline_configure_low_latency(GstElement *encoder)
+{
+	GString *set = g_string_new(NULL);
+
+	// va encoders
+	set_property_if_exists(encoder, "b-frames", "0", set);
+	set_property_if_exists(encoder, "ref-frames", "1", set);
+
+	// vaapi (legacy) encoders
+	set_property_if_exists(encoder, "max-bframes", "0", set);
+	set_property_if_exists(encoder, "refs", "1", set);
+
+	// Not exposed by the VA encoders today, but don't let
+	// any future lookahead add frames of delay.
+	set_property_if_exists(encoder, "rc-lookahead", "0", set);
+
+	// Nothing to set on the parser. With the au/tu alignment the
+	// encoders output it passes every access unit on as it comes
+	// in, instead of waiting for the start of the next one.
+
+	return g_string_free(set, FALSE);
+}
+
+void pipeline_force_keyframe(GstElement *encoder)
+{
+	GstPad *pad = gst_element_get_static_pad(encoder, "src");
+	gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+	gst_object_unref(pad);
+}
+
+GstCaps *pipeline_get_trace_caps(const trace_header_t *header)
+{
+	GstCaps *caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING,
+					    gst_video_format_to_string(header->format), "framerate", GST_TYPE_FRACTION,
+					    header->fps_num, header->fps_den, "width", G_TYPE_INT, header->width,
+					    "height", G_TYPE_INT, header->height, "interlace-mode", G_TYPE_STRING,
+					    "progressive", NULL);
+
+	if (header->colorimetry[0] != '\0') {
+		gchar *colorimetry = g_strndup(header->colorimetry, sizeof(header->colorimetry));
+		gst_caps_set_simple(caps, "colorimetry", G_TYPE_STRING, colorimetry, NULL);
+		g_free(colorimetry);
+	}
+
+	return caps;
+}
+
+GstBuffer *pipeline_wrap_trace_frame(trace_t *trace, uint64_t index, gpointer user_data, GDestroyNotify notify,
+				     const trace_frame_t **frame)
+{
+	trace_header_t *header = trace->header;
+	const GstVideoFormatInfo *format_info = gst_video_format_get_info(header->format);
+	guint planes = GST_VIDEO_FORMAT_INFO_N_PLANES(format_info);
+	const uint8_t *data;
+
+	*frame = trace_get_frame(trace, index, &data);
+
+	if (*frame == NULL || planes == 0 || planes > TRACE_MAX_PLANES || header->plane_height[planes - 1] == 0) {
+		return NULL;
+	}
+
+	GstBuffer *buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer)data, header->frame_size,
+							0, header->frame_size, user_data, notify);
+
+	gsize offset[GST_VIDEO_MAX_PLANES] = {0};
+	gint stride[GST_VIDEO_MAX_PLANES] = {0};
+
+	for (guint p = 0; p < planes; p++) {
+		offset[p] = (*frame)->offset[p];
+		stride[p] = (*frame)->linesize[p];
+	}
+
+	gst_buffer_add_video_meta_full(buffer, 0, header->format, header->width, header->height, planes, offset,
+				       stride);
+
+	GST_BUFFER_PTS(buffer) =
+		gst_util_uint64_scale((*frame)->pts, GST_SECOND * header->timebase_num, header->timebase_den);
+
+	return buffer;
+}
+
+void pipeline_builder_add(pipeline_builder_t *builder, GstElement *element, const char *reason)
+{
+	g_assert(builder->count < G_N_ELEMENTS(builder->elements));
+
+	builder->elements[builder->count] = element;
+	builder->reasons[builder->count] = reason;
+	builder->count++;
+}
+
+bool pipeline_builder_build(pipeline_builder_t *builder, GstBin *bin, gchar **graph, GError **error)
+{
+	GString *str = g_string_new(NULL);
+	bool ok = true;
+
+	for (guint i = 0; i < builder->count; i++) {
+		gst_bin_add(bin, builder->elements[i]);
+
+		if (i > 0 && ok && !gst_element_link(builder->elements[i - 1], builder->elements[i])) {
+			g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION, "failed to link %s to %s",
+				    GST_OBJECT_NAME(builder->elements[i - 1]), GST_OBJECT_NAME(builder->elements[i]));
+			ok = false;
+		}
+
+		g_string_append_printf(str, "%s%s (%s)", i > 0 ? " ! " : "",
+				       GST_OBJECT_NAME(gst_element_get_factory(builder->elements[i])),
+				       builder->reasons[i]);
+	}
+
+	*graph = g_string_free(str, FALSE);
+
+	return ok;
+}
+
+postproc_decision_t pipeline_builder_add_encoder(pipeline_builder_t *builder, const GstCaps *input_caps,
+						 GstElement *encoder, const char *codec, const char *postproc,
+						 const char *quality)
+{
+	// Encoder settings like the profile may restrict the input caps,
+	// so this has to run after they are applied.
+	GstCaps *encoder_caps = pipeline_get_encoder_caps(encoder);
+	postproc_decision_t decision = pipeline_decide_postproc(input_caps, encoder_caps);
+	gst_caps_unref(encoder_caps);
+
+	if (g_strcmp0(postproc, "always") == 0 && !decision.postproc) {
+		decision.postproc = true;
+		decision.reason = "forced by settings";
+	}
+
+	if (decision.postproc) {
+		GstElement *element = pipeline_make_postproc(GST_OBJECT_NAME(gst_element_get_factory(encoder)));
+
+		// Scaling quality only matters when we actually scale
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), "scale-method")) {
+			gst_util_set_object_arg(G_OBJECT(element), "scale-method", decision.scale ? quality : "fast");
+		}
+
+		pipeline_builder_add(builder, element, decision.reason);
+
+		// videoconvert, the fallback for software encoders, doesn't scale
+		if (decision.scale && g_strcmp0(GST_OBJECT_NAME(gst_element_get_factory(element)), "videoconvert") == 0) {
+			pipeline_builder_add(builder, gst_element_factory_make("videoscale", NULL),
+					     "size not supported by the encoder");
+		}
+	}
+
+	pipeline_builder_add(builder, encoder, "encoder");
+	pipeline_builder_add(builder, pipeline_make_parser(codec), "access units for OBS");
+
+	return decision;
+}
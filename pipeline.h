@@ -0,0 +1,87 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gst/gst.h>
+#include <stdbool.h>
+
+#include "trace.h"
+
+// Encoder pipeline construction shared by the plugin and the tools. Only
+// GStreamer in here, so it can be tested without OBS.
+
+typedef struct {
+	bool postproc;
+	bool scale;
+	const char *reason;
+} postproc_decision_t;
+
+// Whether the encoder can take the input caps as they are or needs a
+// postproc in front, for format conversion or scaling. Only works on caps
+// so it can be checked against any made up encoder caps.
+postproc_decision_t pipeline_decide_postproc(const GstCaps *input_caps, const GstCaps *encoder_caps);
+
+// Sink caps of the encoder for the device it runs on
+GstCaps *pipeline_get_encoder_caps(GstElement *encoder);
+
+// OBS codec name of an encoder element, h264, hevc or av1
+const char *pipeline_get_codec(const char *encoder_name);
+
+// The postproc of the encoder's API and device, videoconvert for anything else
+GstElement *pipeline_make_postproc(const char *encoder_name);
+
+// Parser and packet caps that hand out one access unit per packet
+GstElement *pipeline_make_parser(const char *codec);
+GstCaps *pipeline_get_packet_caps(const char *codec);
+
+// Settings that keep the encoder from holding frames back. Returns what
+// was set, for logging.
+gchar *pipeline_configure_low_latency(GstElement *encoder);
+
+// Forces a keyframe on the next frame that goes into the encoder
+void pipeline_force_keyframe(GstElement *encoder);
+
+// Input caps of a trace, the same the plugin had
+GstCaps *pipeline_get_trace_caps(const trace_header_t *header);
+
+// Wraps frame index of a trace without copying. NULL if the slot is torn
+// or doesn't hold all planes of the format.
+GstBuffer *pipeline_wrap_trace_frame(trace_t *trace, uint64_t index, gpointer user_data, GDestroyNotify notify,
+				     const trace_frame_t **frame);
+
+typedef struct {
+	GstElement *elements[8];
+	const char *reasons[8];
+	guint count;
+} pipeline_builder_t;
+
+void pipeline_builder_add(pipeline_builder_t *builder, GstElement *element, const char *reason);
+
+// Adds and links the elements in order. The graph with the reason for each
+// element is returned in graph, also if linking failed.
+bool pipeline_builder_build(pipeline_builder_t *builder, GstBin *bin, gchar **graph, GError **error);
+
+// Adds the postproc the encoder needs for the input caps, or always with
+// postproc "always", then the encoder and the parser for codec. quality is
+// the scale method in case the postproc scales. Returns the decision.
+postproc_decision_t pipeline_builder_add_encoder(pipeline_builder_t *builder, const GstCaps *input_caps,
+						 GstElement *encoder, const char *codec, const char *postproc,
+						 const char *quality);
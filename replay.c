@@ -0,0 +1,581 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a raw input trace captured by the plugin through the same
+// pipeline, with the captured pacing or as fast as possible. The plugin
+// options recorded in the trace are applied like the plugin does.
+
+#include <gst/app/app.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "analysis.h"
+#include "drop.h"
+#include "lookahead.h"
+#include "pipeline.h"
+#include "trace.h"
+
+typedef struct {
+	bool low_latency;
+	GstClockTime latency_budget;
+	bool scene_detect;
+	gdouble scene_threshold;
+	gint64 scene_min_interval;
+	guint lookahead;
+	bool drop_frames;
+	gchar *postproc;
+	gchar *postproc_quality;
+} options_t;
+
+typedef struct {
+	GMutex mutex;
+	GCond cond;
+	gboolean consumed;
+	trace_header_t *header;
+	FILE *file;
+	guint64 packets;
+	guint64 bytes;
+	GstClockTime output_pts;
+	int64_t last_keyframe_pts;
+	guint dropped_since_keyframe;
+	GstClockTime qp_change_pts;
+	bool qp_change_keyframe;
+	guint64 qp_restarts;
+} replay_t;
+
+typedef struct {
+	GstBuffer *buffer;
+	gdouble complexity;
+	bool force_keyframe;
+} lookahead_frame_t;
+
+static gchar *encoder_name = NULL;
+static gboolean fast = FALSE;
+static gchar *output = NULL;
+
+static GOptionEntry entries[] = {
+	{"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name,
+	 "Encoder element (default: the traced one, or a software encoder if unavailable)", "NAME"},
+	{"fast", 'f', 0, G_OPTION_ARG_NONE, &fast, "Push frames as fast as possible instead of the captured pacing",
+	 NULL},
+	{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the encoded stream to FILE", "FILE"},
+	{NULL},
+};
+
+static void destroy_notify(void *data)
+{
+	replay_t *replay = data;
+
+	g_mutex_lock(&replay->mutex);
+	replay->consumed = TRUE;
+	g_cond_signal(&replay->cond);
+	g_mutex_unlock(&replay->mutex);
+}
+
+static const gchar *get_software_encoder(const char *codec)
+{
+	if (g_strcmp0(codec, "h264") == 0) {
+		return "x264enc";
+	} else if (g_strcmp0(codec, "hevc") == 0) {
+		return "x265enc";
+	} else {
+		return "av1enc";
+	}
+}
+
+static void apply_settings(GstElement *encoder, GKeyFile *key_file)
+{
+	gchar **keys = g_key_file_get_keys(key_file, "encoder", NULL, NULL);
+	guint applied = 0;
+	guint skipped = 0;
+
+	for (gchar **key = keys; key && *key; key++) {
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), *key) == NULL) {
+			skipped++;
+			continue;
+		}
+
+		gchar *value = g_key_file_get_string(key_file, "encoder", *key, NULL);
+		gst_util_set_object_arg(G_OBJECT(encoder), *key, value);
+		g_free(value);
+		applied++;
+	}
+
+	g_strfreev(keys);
+
+	g_print("settings: %u applied, %u not supported by the encoder\n", applied, skipped);
+}
+
+// The plugin's defaults where the trace has no value
+static void load_options(GKeyFile *key_file, options_t *options)
+{
+	GError *err = NULL;
+
+	options->low_latency = g_key_file_get_boolean(key_file, "plugin", "low-latency-mode", NULL);
+	options->latency_budget = g_key_file_get_int64(key_file, "plugin", "latency-budget", &err) * GST_MSECOND;
+	if (err) {
+		options->latency_budget = 50 * GST_MSECOND;
+		g_clear_error(&err);
+	}
+
+	options->scene_detect = g_key_file_get_boolean(key_file, "plugin", "scene-cut-detection", NULL);
+	options->scene_threshold = g_key_file_get_double(key_file, "plugin", "scene-cut-threshold", &err);
+	if (err) {
+		options->scene_threshold = 30.0;
+		g_clear_error(&err);
+	}
+	options->scene_min_interval = g_key_file_get_int64(key_file, "plugin", "scene-cut-min-interval", &err);
+	if (err) {
+		options->scene_min_interval = 500;
+		g_clear_error(&err);
+	}
+
+	options->lookahead = g_key_file_get_integer(key_file, "plugin", "lookahead", NULL);
+	options->drop_frames = g_key_file_get_boolean(key_file, "plugin", "drop-frames-on-overload", NULL);
+
+	options->postproc = g_key_file_get_string(key_file, "plugin", "postproc", NULL);
+	if (options->postproc == NULL) {
+		options->postproc = g_strdup("auto");
+	}
+	options->postproc_quality = g_key_file_get_string(key_file, "plugin", "postproc-quality", NULL);
+	if (options->postproc_quality == NULL) {
+		options->postproc_quality = g_strdup("hq");
+	}
+}
+
+static bool pull_packet(replay_t *replay, GstAppSink *appsink, GstClockTime timeout)
+{
+	GstSample *sample = gst_app_sink_try_pull_sample(appsink, timeout);
+
+	if (sample == NULL) {
+		return false;
+	}
+
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+	GstMapInfo info;
+
+	gst_buffer_map(buffer, &info, GST_MAP_READ);
+	if (replay->file) {
+		fwrite(info.data, 1, info.size, replay->file);
+	}
+	replay->bytes += info.size;
+	gst_buffer_unmap(buffer, &info);
+
+	if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+		replay->output_pts = GST_BUFFER_PTS(buffer);
+
+		bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+		// A keyframe nobody asked for right on a QP change
+		if (GST_BUFFER_PTS(buffer) == replay->qp_change_pts) {
+			if (keyframe && !replay->qp_change_keyframe) {
+				replay->qp_restarts++;
+			}
+			replay->qp_change_pts = GST_CLOCK_TIME_NONE;
+		}
+
+		if (keyframe) {
+			replay->last_keyframe_pts = gst_util_uint64_scale(GST_BUFFER_PTS(buffer), replay->header->timebase_den,
+									  GST_SECOND * replay->header->timebase_num);
+			replay->dropped_since_keyframe = 0;
+		}
+	}
+
+	gst_sample_unref(sample);
+	replay->packets++;
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new("TRACE - replay an obs-vaapi input trace");
+	GError *err = NULL;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gst_init_get_option_group());
+
+	if (!g_option_context_parse(context, &argc, &argv, &err) || argc != 2) {
+		g_printerr("%s\n", err ? err->message : "missing trace file");
+		g_printerr("%s", g_option_context_get_help(context, TRUE, NULL));
+		return 1;
+	}
+	g_option_context_free(context);
+
+	trace_t *trace = trace_open(argv[1], &err);
+	if (trace == NULL) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return 1;
+	}
+
+	trace_header_t *header = trace->header;
+
+	const gchar *name = encoder_name ? encoder_name : header->encoder;
+	GstElement *encoder = gst_element_factory_make(name, NULL);
+	if (encoder == NULL && encoder_name == NULL) {
+		// No VA device, e.g. on CI
+		name = get_software_encoder(header->codec);
+		encoder = gst_element_factory_make(name, NULL);
+		g_print("%s not available, using %s\n", header->encoder, name);
+	}
+
+	if (encoder == NULL) {
+		g_printerr("missing GStreamer elements for %s\n", name);
+		return 1;
+	}
+
+	GKeyFile *key_file = g_key_file_new();
+	g_key_file_load_from_data(key_file, trace_get_settings(trace), -1, G_KEY_FILE_NONE, NULL);
+
+	options_t options = {0};
+	load_options(key_file, &options);
+
+	apply_settings(encoder, key_file);
+	g_key_file_free(key_file);
+
+	if (options.low_latency) {
+		gchar *set = pipeline_configure_low_latency(encoder);
+		g_print("low-latency: %s\n", set);
+		g_free(set);
+	}
+
+	GstElement *pipe = gst_pipeline_new(NULL);
+	GstElement *appsrc = gst_element_factory_make("appsrc", NULL);
+	GstElement *appsink = gst_element_factory_make("appsink", NULL);
+
+	GstCaps *caps = pipeline_get_trace_caps(header);
+	g_object_set(appsrc, "caps", caps, "max-bytes", (guint64)header->frame_size * 2, NULL);
+
+	gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+	GstCaps *packet_caps = pipeline_get_packet_caps(header->codec);
+	g_object_set(appsink, "caps", packet_caps, "sync", FALSE, NULL);
+	gst_caps_unref(packet_caps);
+
+	pipeline_builder_t builder = {0};
+
+	pipeline_builder_add(&builder, appsrc, "raw frames from the trace");
+	pipeline_builder_add_encoder(&builder, caps, encoder, header->codec, options.postproc, options.postproc_quality);
+	pipeline_builder_add(&builder, appsink, "packets");
+	gst_caps_unref(caps);
+
+	gchar *graph = NULL;
+
+	if (!pipeline_builder_build(&builder, GST_BIN(pipe), &graph, &err)) {
+		g_printerr("%s\n%s\n", err->message, graph);
+		return 1;
+	}
+
+	g_print("pipeline: %s\n", graph);
+	g_free(graph);
+
+	lookahead_t lookahead_qp = {0};
+	GQueue lookahead_queue = G_QUEUE_INIT;
+
+	if (options.lookahead && !lookahead_setup(&lookahead_qp, encoder)) {
+		g_print("lookahead: needs rate-control cqp, disabled\n");
+		options.lookahead = 0;
+	}
+
+	analysis_t *analysis = NULL;
+	int64_t scene_min_frames = 0;
+
+	if (options.scene_detect || options.lookahead) {
+		switch (header->format) {
+		case GST_VIDEO_FORMAT_I420:
+		case GST_VIDEO_FORMAT_NV12:
+		case GST_VIDEO_FORMAT_Y444:
+			analysis = analysis_create(header->width, header->height);
+			scene_min_frames = options.scene_min_interval * header->fps_num / (header->fps_den * 1000);
+			break;
+		default:
+			g_print("scene-cut detection and lookahead need 8-bit YUV, disabled\n");
+			options.scene_detect = false;
+			options.lookahead = 0;
+			break;
+		}
+	}
+
+	drop_t drop = {0};
+	guint gop_frames = 0;
+
+	if (options.drop_frames) {
+		drop.frame_duration = (gdouble)G_USEC_PER_SEC * header->fps_den / header->fps_num;
+
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "key-int-max")) {
+			g_object_get(encoder, "key-int-max", &gop_frames, NULL);
+		} else if (g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "keyframe-period")) {
+			g_object_get(encoder, "keyframe-period", &gop_frames, NULL);
+		}
+	}
+
+	gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+	replay_t replay = {0};
+	g_mutex_init(&replay.mutex);
+	g_cond_init(&replay.cond);
+	replay.header = header;
+	replay.output_pts = GST_CLOCK_TIME_NONE;
+	replay.qp_change_pts = GST_CLOCK_TIME_NONE;
+
+	if (output) {
+		replay.file = fopen(output, "wb");
+		if (replay.file == NULL) {
+			g_printerr("%s: %s\n", output, g_strerror(errno));
+			return 1;
+		}
+	}
+
+	guint64 count = trace_get_frame_count(trace);
+	guint64 frames = 0;
+	guint64 torn = 0;
+	guint64 scene_cuts = 0;
+	guint64 late_frames = 0;
+	guint64 qp_changes = 0;
+	guint64 dropped = 0;
+	gint64 first_capture = 0;
+	gint64 input_time = 0;
+	gint64 input_time_max = 0;
+	gint64 start = g_get_monotonic_time();
+
+	for (guint64 i = 0; i < count; i++) {
+		const trace_frame_t *frame;
+		GstBuffer *buffer = pipeline_wrap_trace_frame(trace, i, &replay, destroy_notify, &frame);
+
+		if (buffer == NULL) {
+			torn++;
+			continue;
+		}
+
+		if (first_capture == 0) {
+			first_capture = frame->capture_time;
+		}
+
+		if (!fast) {
+			gint64 delay = start + (frame->capture_time - first_capture) - g_get_monotonic_time();
+			if (delay > 0) {
+				g_usleep(delay);
+			}
+		}
+
+		gdouble temporal = 0.0;
+		gdouble spatial = 0.0;
+		bool force_keyframe = false;
+
+		if (analysis) {
+			GstMapInfo info;
+
+			gst_buffer_map(buffer, &info, GST_MAP_READ);
+			analysis_frame(analysis, info.data + frame->offset[0], frame->linesize[0], &temporal, &spatial);
+			gst_buffer_unmap(buffer, &info);
+
+			if (options.scene_detect &&
+			    analysis_is_scene_cut(temporal, options.scene_threshold,
+						  frame->pts - replay.last_keyframe_pts, scene_min_frames)) {
+				force_keyframe = true;
+				scene_cuts++;
+			}
+		}
+
+		// Like the plugin, drop on overload but never a scene cut
+		if (options.drop_frames && !force_keyframe) {
+			if (drop_next_frame(&drop, false)) {
+				gst_buffer_unref(buffer);
+				replay.dropped_since_keyframe++;
+				dropped++;
+
+				while (pull_packet(&replay, GST_APP_SINK(appsink), 0)) {
+				}
+				continue;
+			}
+
+			if (replay.dropped_since_keyframe && gop_frames &&
+			    frame->pts - replay.last_keyframe_pts >= gop_frames) {
+				force_keyframe = true;
+				replay.dropped_since_keyframe = 0;
+			}
+		}
+
+		bool qp_changed = false;
+
+		// The trace is mapped, holding frames back costs no copies
+		if (options.lookahead) {
+			lookahead_frame_t *entry = g_new0(lookahead_frame_t, 1);
+
+			entry->buffer = buffer;
+			entry->complexity = temporal + spatial;
+			entry->force_keyframe = force_keyframe;
+
+			g_queue_push_tail(&lookahead_queue, entry);
+			lookahead_add(&lookahead_qp, entry->complexity);
+
+			if (g_queue_get_length(&lookahead_queue) <= options.lookahead) {
+				continue;
+			}
+
+			gdouble complexity = 0.0;
+			for (GList *elem = lookahead_queue.head; elem != NULL; elem = elem->next) {
+				complexity += ((lookahead_frame_t *)elem->data)->complexity;
+			}
+			complexity /= g_queue_get_length(&lookahead_queue);
+
+			qp_changed = lookahead_update(&lookahead_qp, encoder, complexity);
+
+			entry = g_queue_pop_head(&lookahead_queue);
+			buffer = entry->buffer;
+			force_keyframe = entry->force_keyframe;
+			g_free(entry);
+
+			lookahead_apply(&lookahead_qp, buffer, header->width, header->height);
+		}
+
+		if (force_keyframe) {
+			pipeline_force_keyframe(encoder);
+		}
+
+		GstClockTime pts = GST_BUFFER_PTS(buffer);
+		gint64 push = g_get_monotonic_time();
+
+		// Like the plugin, block until the frame got consumed
+		g_mutex_lock(&replay.mutex);
+		replay.consumed = FALSE;
+
+		if (qp_changed) {
+			replay.qp_change_pts = pts;
+			replay.qp_change_keyframe = force_keyframe;
+			qp_changes++;
+		}
+
+		gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+
+		gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+		while (!replay.consumed) {
+			if (!g_cond_wait_until(&replay.cond, &replay.mutex, deadline)) {
+				g_printerr("pipeline stalled\n");
+				return 1;
+			}
+		}
+		g_mutex_unlock(&replay.mutex);
+
+		gint64 elapsed = g_get_monotonic_time() - push;
+		input_time += elapsed;
+		input_time_max = MAX(input_time_max, elapsed);
+		drop_add_encode_time(&drop, elapsed);
+		frames++;
+
+		// Like the plugin in low-latency mode, wait for the packet of
+		// this frame within the budget
+		if (options.low_latency) {
+			gint64 budget_end = push + options.latency_budget / GST_USECOND;
+
+			while (!GST_CLOCK_TIME_IS_VALID(replay.output_pts) || replay.output_pts < pts) {
+				gint64 remaining = budget_end - g_get_monotonic_time();
+
+				if (remaining <= 0 ||
+				    !pull_packet(&replay, GST_APP_SINK(appsink), remaining * GST_USECOND)) {
+					late_frames++;
+					break;
+				}
+			}
+		}
+
+		while (pull_packet(&replay, GST_APP_SINK(appsink), 0)) {
+		}
+	}
+
+	// Like in the plugin, frames still in the lookahead are lost
+	lookahead_frame_t *entry;
+	while ((entry = g_queue_pop_head(&lookahead_queue)) != NULL) {
+		gst_buffer_unref(entry->buffer);
+		g_free(entry);
+	}
+
+	gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+	while (pull_packet(&replay, GST_APP_SINK(appsink), 5 * GST_SECOND)) {
+	}
+
+	gint64 wall = g_get_monotonic_time() - start;
+
+	GstBus *bus = gst_element_get_bus(pipe);
+	GstMessage *message = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+	if (message) {
+		gst_message_parse_error(message, &err, NULL);
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		gst_message_unref(message);
+	}
+	gst_object_unref(bus);
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(pipe);
+
+	if (replay.file) {
+		fclose(replay.file);
+	}
+
+	gdouble duration = (gdouble)frames * header->fps_den / header->fps_num;
+
+	g_print("encoder: %s, %ux%u@%u/%u, %s\n", name, header->width, header->height, header->fps_num,
+		header->fps_den, gst_video_format_to_string(header->format));
+	g_print("frames: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " torn), packets: %" G_GUINT64_FORMAT "\n",
+		frames, torn, replay.packets);
+	g_print("time: %.3f s, %.2f fps\n", wall / (gdouble)G_USEC_PER_SEC,
+		frames / (wall / (gdouble)G_USEC_PER_SEC));
+	g_print("input latency: %.3f ms avg, %.3f ms max\n", frames ? input_time / 1000.0 / frames : 0.0,
+		input_time_max / 1000.0);
+	g_print("bitrate: %.0f kbit/s\n", duration > 0.0 ? replay.bytes * 8 / duration / 1000.0 : 0.0);
+
+	if (options.low_latency) {
+		g_print("low-latency: %" G_GUINT64_FORMAT " frames missed the %" G_GUINT64_FORMAT " ms budget\n",
+			late_frames, options.latency_budget / GST_MSECOND);
+	}
+
+	if (options.drop_frames) {
+		g_print("overload: %" G_GUINT64_FORMAT " frames dropped\n", dropped);
+	}
+
+	if (options.scene_detect) {
+		g_print("scene cuts: %" G_GUINT64_FORMAT "\n", scene_cuts);
+	}
+
+	// On a VA encoder this tells whether QP changes restart the sequence
+	if (options.lookahead) {
+		g_print("lookahead: %" G_GUINT64_FORMAT " QP changes, %" G_GUINT64_FORMAT
+			" of them started a new sequence\n",
+			qp_changes, replay.qp_restarts);
+	}
+
+	if (analysis) {
+		analysis_destroy(analysis);
+	}
+
+	g_free(options.postproc);
+	g_free(options.postproc_quality);
+
+	g_mutex_clear(&replay.mutex);
+	g_cond_clear(&replay.cond);
+
+	trace_close(trace);
+
+	return 0;
+}
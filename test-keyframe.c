@@ -0,0 +1,127 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Rate limit and coalescing of keyframe requests
+
+#include <glib.h>
+
+#include "keyframe.h"
+
+#define MS G_TIME_SPAN_MILLISECOND
+
+static void test_burst(void)
+{
+	keyframe_requests_t k = {.interval = 2000 * MS};
+	gint64 request_time;
+
+	// A flood of reconnects ends up in one keyframe
+	for (gint i = 0; i < 10; i++) {
+		keyframe_request(&k, (10 + i) * MS);
+	}
+
+	g_assert_true(keyframe_send(&k, 20 * MS, false));
+	g_assert_false(keyframe_send(&k, 21 * MS, false));
+
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 10);
+	g_assert_cmpint(request_time, ==, 10 * MS);
+
+	// Nothing left over
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 0);
+	g_assert_cmpint(request_time, ==, 0);
+	g_assert_false(keyframe_is_due(&k, 10000 * MS));
+}
+
+static void test_interval(void)
+{
+	keyframe_requests_t k = {.interval = 2000 * MS};
+	gint64 request_time;
+
+	keyframe_request(&k, 100 * MS);
+	g_assert_true(keyframe_send(&k, 100 * MS, false));
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 1);
+
+	// Too early for another one, but the request is kept
+	keyframe_request(&k, 1500 * MS);
+	g_assert_false(keyframe_is_due(&k, 2099 * MS));
+	g_assert_false(keyframe_send(&k, 2099 * MS, false));
+
+	g_assert_true(keyframe_is_due(&k, 2100 * MS));
+	g_assert_true(keyframe_send(&k, 2100 * MS, false));
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 1);
+	g_assert_cmpint(request_time, ==, 1500 * MS);
+}
+
+static void test_force(void)
+{
+	keyframe_requests_t k = {.interval = 2000 * MS};
+	gint64 request_time;
+
+	keyframe_request(&k, 100 * MS);
+	g_assert_true(keyframe_send(&k, 100 * MS, false));
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 1);
+
+	// Keyframes placed by the plugin pass the limit and take pending
+	// requests along
+	keyframe_request(&k, 1200 * MS);
+	g_assert_true(keyframe_send(&k, 1300 * MS, true));
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 1);
+	g_assert_cmpint(request_time, ==, 1200 * MS);
+
+	// Forced without requests there is nobody to report
+	g_assert_true(keyframe_send(&k, 1400 * MS, true));
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 0);
+}
+
+static void test_handoff(void)
+{
+	keyframe_requests_t k = {.interval = 2000 * MS};
+	gint64 request_time;
+
+	keyframe_request(&k, 100 * MS);
+	g_assert_true(keyframe_send(&k, 100 * MS, false));
+
+	// While the keyframe is in the encoder, new requests fold into it
+	keyframe_request(&k, 500 * MS);
+	g_assert_false(keyframe_is_due(&k, 5000 * MS));
+
+	// Later ones wait for the next
+	keyframe_request(&k, 1200 * MS);
+	g_assert_false(keyframe_is_due(&k, 1200 * MS));
+
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 2);
+	g_assert_cmpint(request_time, ==, 100 * MS);
+
+	// A regular keyframe of the encoder serves the pending one
+	g_assert_cmpuint(keyframe_served(&k, &request_time), ==, 1);
+	g_assert_cmpint(request_time, ==, 1200 * MS);
+	g_assert_false(keyframe_is_due(&k, 5000 * MS));
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/keyframe/burst", test_burst);
+	g_test_add_func("/keyframe/interval", test_interval);
+	g_test_add_func("/keyframe/force", test_force);
+	g_test_add_func("/keyframe/handoff", test_handoff);
+
+	return g_test_run();
+}
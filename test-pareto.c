@@ -0,0 +1,118 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Preset selection of obs-vaapi-tune on made up measurements
+
+#include <glib.h>
+
+#include "pareto.h"
+
+static void test_dominated(void)
+{
+	pareto_point_t points[] = {
+		{.fps = 200, .latency = 5, .bitrate = 4000, .psnr = 40},
+		// Slower, later, bigger and worse
+		{.fps = 100, .latency = 10, .bitrate = 5000, .psnr = 38},
+		// Only worse in one metric
+		{.fps = 200, .latency = 5, .bitrate = 4000, .psnr = 39},
+	};
+
+	pareto_find(points, G_N_ELEMENTS(points));
+
+	g_assert_true(points[0].pareto);
+	g_assert_false(points[1].pareto);
+	g_assert_false(points[2].pareto);
+
+	g_assert_true(pareto_dominates(&points[0], &points[1]));
+	g_assert_false(pareto_dominates(&points[1], &points[0]));
+	g_assert_false(pareto_dominates(&points[0], &points[0]));
+}
+
+static void test_trade_off(void)
+{
+	pareto_point_t points[] = {
+		{.fps = 400, .latency = 3, .bitrate = 6000, .psnr = 36},
+		{.fps = 100, .latency = 12, .bitrate = 3000, .psnr = 42},
+		// Equal points don't dominate each other
+		{.fps = 100, .latency = 12, .bitrate = 3000, .psnr = 42},
+	};
+
+	pareto_find(points, G_N_ELEMENTS(points));
+
+	g_assert_true(points[0].pareto);
+	g_assert_true(points[1].pareto);
+	g_assert_true(points[2].pareto);
+}
+
+static void test_failed(void)
+{
+	pareto_point_t points[] = {
+		// Failed runs have no measurements, they'd dominate nothing
+		// but must not be picked either
+		{.failed = true},
+		{.fps = 100, .latency = 10, .bitrate = 5000, .psnr = 38},
+		// Would dominate the others if it hadn't failed
+		{.failed = true, .fps = 1000, .latency = 1, .bitrate = 100, .psnr = 50},
+	};
+
+	pareto_find(points, G_N_ELEMENTS(points));
+
+	g_assert_false(points[0].pareto);
+	g_assert_true(points[1].pareto);
+	g_assert_false(points[2].pareto);
+}
+
+static void test_names(void)
+{
+	pareto_point_t points[] = {
+		{.fps = 400, .latency = 3, .bitrate = 6000, .psnr = 36},
+		{.fps = 100, .latency = 12, .bitrate = 3000, .psnr = 42},
+		{.fps = 200, .latency = 6, .bitrate = 4000, .psnr = 39},
+		// Dominated, doesn't count for the others' names
+		{.fps = 50, .latency = 20, .bitrate = 9000, .psnr = 30},
+	};
+
+	pareto_find(points, G_N_ELEMENTS(points));
+	g_assert_false(points[3].pareto);
+
+	gchar *name = pareto_get_name(points, G_N_ELEMENTS(points), 0);
+	g_assert_cmpstr(name, ==, "Tuned 0, fastest, lowest latency");
+	g_free(name);
+
+	name = pareto_get_name(points, G_N_ELEMENTS(points), 1);
+	g_assert_cmpstr(name, ==, "Tuned 1, smallest, best quality");
+	g_free(name);
+
+	name = pareto_get_name(points, G_N_ELEMENTS(points), 2);
+	g_assert_cmpstr(name, ==, "Tuned 2");
+	g_free(name);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/pareto/dominated", test_dominated);
+	g_test_add_func("/pareto/trade-off", test_trade_off);
+	g_test_add_func("/pareto/failed", test_failed);
+	g_test_add_func("/pareto/names", test_names);
+
+	return g_test_run();
+}
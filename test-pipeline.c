@@ -0,0 +1,341 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Postproc decisions and the builder against made up encoder caps
+
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+#define INPUT_CAPS                                                                                          \
+	"video/x-raw, format=NV12, width=1920, height=1080, framerate=60/1, interlace-mode=progressive, " \
+	"colorimetry=bt709"
+
+static postproc_decision_t decide(const char *input, const char *encoder)
+{
+	GstCaps *input_caps = gst_caps_from_string(input);
+	GstCaps *encoder_caps = encoder ? gst_caps_from_string(encoder) : NULL;
+
+	postproc_decision_t decision = pipeline_decide_postproc(input_caps, encoder_caps);
+
+	if (encoder_caps) {
+		gst_caps_unref(encoder_caps);
+	}
+	gst_caps_unref(input_caps);
+
+	return decision;
+}
+
+static void test_no_postproc(void)
+{
+	postproc_decision_t decision =
+		decide(INPUT_CAPS, "video/x-raw, format={ NV12, P010_10LE }, width=[16, 4096], height=[16, 4096]");
+
+	g_assert_false(decision.postproc);
+	g_assert_false(decision.scale);
+
+	// Encoders that don't restrict colorimetry take any
+	decision = decide(INPUT_CAPS, "video/x-raw, format=NV12");
+
+	g_assert_false(decision.postproc);
+}
+
+static void test_scale(void)
+{
+	postproc_decision_t decision =
+		decide(INPUT_CAPS, "video/x-raw, format=NV12, width=[16, 1280], height=[16, 720]");
+
+	g_assert_true(decision.postproc);
+	g_assert_true(decision.scale);
+	g_assert_cmpstr(decision.reason, ==, "size not supported by the encoder");
+}
+
+static void test_convert(void)
+{
+	postproc_decision_t decision =
+		decide(INPUT_CAPS, "video/x-raw, format=P010_10LE, width=[16, 4096], height=[16, 4096]");
+
+	g_assert_true(decision.postproc);
+	g_assert_false(decision.scale);
+	g_assert_cmpstr(decision.reason, ==, "format or colorimetry not supported by the encoder");
+
+	decision = decide(INPUT_CAPS, "video/x-raw, format=NV12, width=[16, 4096], height=[16, 4096], "
+				      "colorimetry=bt601");
+
+	g_assert_true(decision.postproc);
+	g_assert_false(decision.scale);
+
+	// Converting and scaling at once
+	decision = decide(INPUT_CAPS, "video/x-raw, format=P010_10LE, width=[16, 1280], height=[16, 720]");
+
+	g_assert_true(decision.postproc);
+	g_assert_true(decision.scale);
+	g_assert_cmpstr(decision.reason, ==, "format or colorimetry not supported by the encoder");
+
+	// Encoders that only take device memory
+	decision = decide(INPUT_CAPS, "video/x-raw(memory:VAMemory), format=NV12, width=[16, 4096], "
+				      "height=[16, 4096]");
+
+	g_assert_true(decision.postproc);
+	g_assert_false(decision.scale);
+}
+
+static void test_unknown(void)
+{
+	postproc_decision_t decision = decide(INPUT_CAPS, NULL);
+
+	g_assert_true(decision.postproc);
+	g_assert_cmpstr(decision.reason, ==, "encoder caps unknown");
+
+	decision = decide(INPUT_CAPS, "EMPTY");
+
+	g_assert_true(decision.postproc);
+	g_assert_cmpstr(decision.reason, ==, "encoder caps unknown");
+}
+
+static void test_builder(void)
+{
+	GstElement *bin = gst_bin_new(NULL);
+	pipeline_builder_t builder = {0};
+	gchar *graph = NULL;
+	GError *err = NULL;
+
+	pipeline_builder_add(&builder, gst_element_factory_make("fakesrc", NULL), "source");
+	pipeline_builder_add(&builder, gst_element_factory_make("identity", NULL), "filter");
+	pipeline_builder_add(&builder, gst_element_factory_make("fakesink", NULL), "sink");
+
+	g_assert_true(pipeline_builder_build(&builder, GST_BIN(bin), &graph, &err));
+	g_assert_no_error(err);
+	g_assert_cmpstr(graph, ==, "fakesrc (source) ! identity (filter) ! fakesink (sink)");
+
+	g_free(graph);
+	gst_object_unref(bin);
+
+	// A sink in the middle has nothing to link from
+	bin = gst_bin_new(NULL);
+	builder = (pipeline_builder_t){0};
+
+	pipeline_builder_add(&builder, gst_element_factory_make("fakesrc", NULL), "source");
+	pipeline_builder_add(&builder, gst_element_factory_make("fakesink", NULL), "sink");
+	pipeline_builder_add(&builder, gst_element_factory_make("fakesink", NULL), "sink");
+
+	g_assert_false(pipeline_builder_build(&builder, GST_BIN(bin), &graph, &err));
+	g_assert_error(err, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION);
+	g_assert_nonnull(graph);
+
+	g_clear_error(&err);
+	g_free(graph);
+	gst_object_unref(bin);
+}
+
+static void test_names(void)
+{
+	g_assert_cmpstr(pipeline_get_codec("vah264lpenc"), ==, "h264");
+	g_assert_cmpstr(pipeline_get_codec("varenderD129h265enc"), ==, "hevc");
+	g_assert_cmpstr(pipeline_get_codec("vaapih265enc"), ==, "hevc");
+	g_assert_cmpstr(pipeline_get_codec("vaav1enc"), ==, "av1");
+	g_assert_cmpstr(pipeline_get_codec("x264enc"), ==, "h264");
+
+	GstCaps *caps = pipeline_get_packet_caps("av1");
+	g_assert_cmpstr(gst_structure_get_string(gst_caps_get_structure(caps, 0), "alignment"), ==, "tu");
+	gst_caps_unref(caps);
+}
+
+// NV12 with padded strides must come back as written
+static void test_trace_frame(void)
+{
+	const guint32 width = 64;
+	const guint32 height = 16;
+	const guint32 stride = 96;
+
+	guint8 *data = g_malloc0(stride * height * 3 / 2);
+	memset(data + stride * height, 200, stride * height / 2);
+	for (guint32 y = 0; y < height; y++) {
+		memset(data + y * stride, y, width);
+	}
+
+	uint8_t *planes[TRACE_MAX_PLANES] = {data, data + stride * height};
+	uint32_t linesize[TRACE_MAX_PLANES] = {stride, stride};
+
+	trace_header_t info = {0};
+	info.width = width;
+	info.height = height;
+	info.format = GST_VIDEO_FORMAT_NV12;
+	info.fps_num = 30;
+	info.fps_den = 1;
+	info.timebase_num = 1;
+	info.timebase_den = 30;
+	info.slot_count = 2;
+	info.plane_height[0] = height;
+	info.plane_height[1] = height / 2;
+	g_strlcpy(info.colorimetry, "bt709", sizeof(info.colorimetry));
+
+	info.frame_size = trace_get_frame_size(planes, linesize, info.plane_height);
+	g_assert_cmpuint(info.frame_size, ==, stride * height * 3 / 2);
+
+	gchar *path = NULL;
+	gint fd = g_file_open_tmp("obs-vaapi-XXXXXX.trace", &path, NULL);
+	g_assert_cmpint(fd, >=, 0);
+	g_close(fd, NULL);
+
+	trace_t *trace = trace_create(path, &info, "", "{}", NULL);
+	g_assert_nonnull(trace);
+
+	g_assert_true(trace_write(trace, 0, 0, planes, linesize));
+
+	// Wider strides than the first frame don't fit the slot
+	uint32_t wider[TRACE_MAX_PLANES] = {stride * 2, stride * 2};
+	g_assert_false(trace_write(trace, 1, 0, planes, wider));
+
+	trace_close(trace);
+
+	trace = trace_open(path, NULL);
+	g_assert_nonnull(trace);
+	g_assert_cmpuint(trace_get_frame_count(trace), ==, 1);
+
+	GstCaps *caps = pipeline_get_trace_caps(trace->header);
+	g_assert_cmpstr(gst_structure_get_string(gst_caps_get_structure(caps, 0), "colorimetry"), ==, "bt709");
+
+	GstVideoInfo video_info;
+	gst_video_info_from_caps(&video_info, caps);
+	gst_caps_unref(caps);
+
+	const trace_frame_t *frame;
+	GstBuffer *buffer = pipeline_wrap_trace_frame(trace, 0, NULL, NULL, &frame);
+	g_assert_nonnull(buffer);
+
+	GstVideoFrame video_frame;
+	g_assert_true(gst_video_frame_map(&video_frame, &video_info, buffer, GST_MAP_READ));
+
+	const guint8 *luma = GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 0);
+	const guint8 *chroma = GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 1);
+
+	g_assert_cmpint(GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 0), ==, stride);
+	g_assert_cmpuint(luma[(height - 1) * stride + width - 1], ==, height - 1);
+	g_assert_cmpuint(chroma[(height / 2 - 1) * stride + width - 1], ==, 200);
+
+	gst_video_frame_unmap(&video_frame);
+	gst_buffer_unref(buffer);
+	trace_close(trace);
+
+	g_unlink(path);
+	g_free(path);
+	g_free(data);
+}
+
+// Rewrites the header of a valid trace, trace_open must reject it
+static void check_corrupt_header(const gchar *path, void (*corrupt)(trace_header_t *header))
+{
+	gchar *contents = NULL;
+	gsize length = 0;
+	g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+
+	gchar *copy = g_build_filename(g_get_tmp_dir(), "obs-vaapi-corrupt.trace", NULL);
+	corrupt((trace_header_t *)contents);
+	g_assert_true(g_file_set_contents(copy, contents, length, NULL));
+
+	GError *err = NULL;
+	g_assert_null(trace_open(copy, &err));
+	g_assert_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+	g_error_free(err);
+
+	g_unlink(copy);
+	g_free(copy);
+	g_free(contents);
+}
+
+static void corrupt_settings_overflow(trace_header_t *header)
+{
+	header->settings_offset = G_MAXUINT64 - 8;
+	header->settings_size = 16;
+}
+
+static void corrupt_json_unterminated(trace_header_t *header)
+{
+	header->json_size--;
+}
+
+static void corrupt_codec_unterminated(trace_header_t *header)
+{
+	memset(header->codec, 'x', sizeof(header->codec));
+}
+
+static void corrupt_slots_overflow(trace_header_t *header)
+{
+	header->slot_count = G_MAXUINT64 / header->slot_size + 2;
+}
+
+static void test_trace_corrupt(void)
+{
+	uint8_t *planes[TRACE_MAX_PLANES] = {NULL};
+	uint32_t linesize[TRACE_MAX_PLANES] = {64};
+
+	trace_header_t info = {0};
+	info.width = 64;
+	info.height = 16;
+	info.format = GST_VIDEO_FORMAT_GRAY8;
+	info.fps_num = 30;
+	info.fps_den = 1;
+	info.slot_count = 2;
+	info.plane_height[0] = 16;
+
+	guint8 *data = g_malloc0(64 * 16);
+	planes[0] = data;
+	info.frame_size = trace_get_frame_size(planes, linesize, info.plane_height);
+
+	gchar *path = NULL;
+	gint fd = g_file_open_tmp("obs-vaapi-XXXXXX.trace", &path, NULL);
+	g_assert_cmpint(fd, >=, 0);
+	g_close(fd, NULL);
+
+	trace_t *trace = trace_create(path, &info, "[plugin]", "{}", NULL);
+	g_assert_nonnull(trace);
+	g_assert_true(trace_write(trace, 0, 0, planes, linesize));
+	trace_close(trace);
+
+	check_corrupt_header(path, corrupt_settings_overflow);
+	check_corrupt_header(path, corrupt_json_unterminated);
+	check_corrupt_header(path, corrupt_codec_unterminated);
+	check_corrupt_header(path, corrupt_slots_overflow);
+
+	g_unlink(path);
+	g_free(path);
+	g_free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	gst_init(&argc, &argv);
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/pipeline/no-postproc", test_no_postproc);
+	g_test_add_func("/pipeline/scale", test_scale);
+	g_test_add_func("/pipeline/convert", test_convert);
+	g_test_add_func("/pipeline/unknown", test_unknown);
+	g_test_add_func("/pipeline/builder", test_builder);
+	g_test_add_func("/pipeline/names", test_names);
+	g_test_add_func("/pipeline/trace-frame", test_trace_frame);
+	g_test_add_func("/pipeline/trace-corrupt", test_trace_corrupt);
+
+	return g_test_run();
+}
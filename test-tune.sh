@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# obs-vaapi. OBS Studio plugin.
+# Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+#
+# This file is part of obs-vaapi.
+#
+# obs-vaapi is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# obs-vaapi is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Runs obs-vaapi-tune on x264enc and checks the presets it writes
+
+tune="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+if ! "$tune" --encoder x264enc --width 320 --height 240 --frames 10 --max-points 4 --output "$dir/x264enc.ini" \
+	>"$dir/log" 2>&1; then
+	cat "$dir/log"
+	# Skip without x264enc
+	grep -q "no such element" "$dir/log" && exit 77
+	exit 1
+fi
+
+cat "$dir/log"
+
+if ! grep -q '^\[Tuned [0-9]' "$dir/x264enc.ini"; then
+	echo "no presets written"
+	exit 1
+fi
+
+if ! grep -q '^speed-preset=' "$dir/x264enc.ini"; then
+	echo "presets without speed-preset"
+	exit 1
+fi
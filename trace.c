@@ -0,0 +1,269 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRACE_ALIGN(x) (((x) + 63) & ~(uint64_t)63)
+
+static trace_t *trace_map(const char *path, int fd, size_t size, int prot, GError **error)
+{
+	uint8_t *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	trace_t *trace = g_new0(trace_t, 1);
+
+	trace->fd = fd;
+	trace->map = map;
+	trace->size = size;
+	trace->header = (trace_header_t *)map;
+
+	return trace;
+}
+
+// Planes of the frame within size bytes
+static bool planes_fit(const trace_header_t *header, const uint64_t offset[], const uint32_t linesize[],
+		       uint64_t size)
+{
+	for (int i = 0; i < TRACE_MAX_PLANES && header->plane_height[i]; i++) {
+		if (offset[i] > size || (uint64_t)linesize[i] * header->plane_height[i] > size - offset[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint64_t trace_get_frame_size(uint8_t *const data[], const uint32_t linesize[], const uint32_t plane_height[])
+{
+	uint64_t size = 0;
+
+	for (int i = 0; i < TRACE_MAX_PLANES && data[i] && plane_height[i]; i++) {
+		if (data[i] < data[0]) {
+			return 0;
+		}
+
+		size = MAX(size, (uint64_t)(data[i] - data[0]) + (uint64_t)linesize[i] * plane_height[i]);
+	}
+
+	return size;
+}
+
+trace_t *trace_create(const char *path, const trace_header_t *info, const char *settings, const char *json,
+		      GError **error)
+{
+	trace_header_t header = *info;
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.settings_offset = TRACE_ALIGN(sizeof(trace_header_t));
+	header.settings_size = strlen(settings) + 1;
+	header.json_offset = TRACE_ALIGN(header.settings_offset + header.settings_size);
+	header.json_size = strlen(json) + 1;
+	header.slot_size = TRACE_ALIGN(sizeof(trace_frame_t)) + TRACE_ALIGN(header.frame_size);
+	header.slots_offset = TRACE_ALIGN(header.json_offset + header.json_size);
+	header.frames_written = 0;
+
+	size_t size = header.slots_offset + header.slot_size * header.slot_count;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	trace_t *trace = trace_map(path, fd, size, PROT_READ | PROT_WRITE, error);
+	if (trace == NULL) {
+		return NULL;
+	}
+
+	*trace->header = header;
+	memcpy(trace->map + header.settings_offset, settings, header.settings_size);
+	memcpy(trace->map + header.json_offset, json, header.json_size);
+
+	return trace;
+}
+
+// Written without additions that could wrap around with a corrupt header
+static bool region_fits(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+	return offset <= file_size && size <= file_size - offset;
+}
+
+// A string region that is read with -1 as length must end within itself
+static bool string_fits(const uint8_t *map, uint64_t offset, uint64_t size, uint64_t file_size)
+{
+	return size > 0 && region_fits(offset, size, file_size) && memchr(map + offset, '\0', size) != NULL;
+}
+
+static bool header_is_valid(const trace_t *trace)
+{
+	const trace_header_t *header = trace->header;
+	uint64_t frame_offset = TRACE_ALIGN(sizeof(trace_frame_t));
+
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION) {
+		return false;
+	}
+
+	if (memchr(header->encoder, '\0', sizeof(header->encoder)) == NULL ||
+	    memchr(header->codec, '\0', sizeof(header->codec)) == NULL ||
+	    memchr(header->colorimetry, '\0', sizeof(header->colorimetry)) == NULL) {
+		return false;
+	}
+
+	if (!string_fits(trace->map, header->settings_offset, header->settings_size, trace->size) ||
+	    !string_fits(trace->map, header->json_offset, header->json_size, trace->size)) {
+		return false;
+	}
+
+	if (header->frame_size == 0 || header->slot_count == 0 || header->plane_height[0] == 0 ||
+	    header->slot_size < frame_offset || header->frame_size > header->slot_size - frame_offset) {
+		return false;
+	}
+
+	return header->slots_offset <= trace->size &&
+	       header->slot_size <= (trace->size - header->slots_offset) / header->slot_count;
+}
+
+trace_t *trace_open(const char *path, GError **error)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < sizeof(trace_header_t)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: not a trace file", path);
+		close(fd);
+		return NULL;
+	}
+
+	trace_t *trace = trace_map(path, fd, st.st_size, PROT_READ, error);
+	if (trace == NULL) {
+		return NULL;
+	}
+
+	if (!header_is_valid(trace)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: not a trace file or unsupported version",
+			    path);
+		trace_close(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+void trace_close(trace_t *trace)
+{
+	munmap(trace->map, trace->size);
+	close(trace->fd);
+	g_free(trace);
+}
+
+bool trace_write(trace_t *trace, int64_t pts, int64_t capture_time, uint8_t *const data[], const uint32_t linesize[])
+{
+	trace_header_t *header = trace->header;
+
+	for (int i = 0; i < TRACE_MAX_PLANES && header->plane_height[i]; i++) {
+		if (data[i] == NULL) {
+			return false;
+		}
+	}
+
+	// Strides may change with the source, never copy past the slot
+	uint64_t size = trace_get_frame_size(data, linesize, header->plane_height);
+	if (size == 0 || size > header->frame_size) {
+		return false;
+	}
+
+	uint64_t sequence = header->frames_written + 1;
+	uint8_t *slot = trace->map + header->slots_offset + (sequence - 1) % header->slot_count * header->slot_size;
+	trace_frame_t *frame = (trace_frame_t *)slot;
+
+	// Mark the slot as invalid while it is being overwritten
+	frame->sequence = 0;
+
+	frame->pts = pts;
+	frame->capture_time = capture_time;
+
+	for (int i = 0; i < TRACE_MAX_PLANES; i++) {
+		frame->linesize[i] = header->plane_height[i] ? linesize[i] : 0;
+		frame->offset[i] = header->plane_height[i] ? data[i] - data[0] : 0;
+	}
+
+	memcpy(slot + TRACE_ALIGN(sizeof(trace_frame_t)), data[0], size);
+
+	frame->sequence = sequence;
+	header->frames_written = sequence;
+
+	return true;
+}
+
+uint64_t trace_get_frame_count(trace_t *trace)
+{
+	return MIN(trace->header->frames_written, trace->header->slot_count);
+}
+
+const trace_frame_t *trace_get_frame(trace_t *trace, uint64_t index, const uint8_t **data)
+{
+	trace_header_t *header = trace->header;
+	uint64_t sequence = header->frames_written - trace_get_frame_count(trace) + index + 1;
+	const uint8_t *slot =
+		trace->map + header->slots_offset + (sequence - 1) % header->slot_count * header->slot_size;
+	const trace_frame_t *frame = (const trace_frame_t *)slot;
+
+	// Torn write if the capture got interrupted
+	if (frame->sequence != sequence || !planes_fit(header, frame->offset, frame->linesize, header->frame_size)) {
+		return NULL;
+	}
+
+	*data = slot + TRACE_ALIGN(sizeof(trace_frame_t));
+
+	return frame;
+}
+
+const char *trace_get_settings(trace_t *trace)
+{
+	return (const char *)trace->map + trace->header->settings_offset;
+}
+
+const char *trace_get_json(trace_t *trace)
+{
+	return (const char *)trace->map + trace->header->json_offset;
+}
@@ -0,0 +1,93 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Raw input trace. A header, the encoder settings and a ring of frame
+// slots in a memory-mapped file. Host byte order, not meant to travel
+// between architectures.
+
+#define TRACE_MAGIC "OBSVATRC"
+#define TRACE_VERSION 2
+#define TRACE_MAX_PLANES 8
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format; // GstVideoFormat
+	uint32_t fps_num;
+	uint32_t fps_den;
+	uint32_t timebase_num;
+	uint32_t timebase_den;
+	char encoder[64]; // GStreamer element name
+	char codec[16];   // OBS codec name
+	char colorimetry[32]; // GstVideoColorimetry as string
+	uint32_t plane_height[TRACE_MAX_PLANES]; // Rows per plane, 0 past the last one
+	uint64_t settings_offset; // Encoder properties and plugin options as GKeyFile
+	uint64_t settings_size;
+	uint64_t json_offset; // OBS encoder settings as JSON
+	uint64_t json_size;
+	uint64_t frame_size; // From the first plane to the end of the last one
+	uint64_t slot_size;
+	uint64_t slot_count;
+	uint64_t slots_offset;
+	uint64_t frames_written;
+} trace_header_t;
+
+typedef struct {
+	uint64_t sequence; // 1-based frame number, 0 for an empty slot
+	int64_t pts;
+	int64_t capture_time; // Monotonic microseconds
+	uint32_t linesize[TRACE_MAX_PLANES];
+	uint64_t offset[TRACE_MAX_PLANES]; // Plane offsets into the frame data
+} trace_frame_t;
+
+typedef struct {
+	int fd;
+	uint8_t *map;
+	size_t size;
+	trace_header_t *header;
+} trace_t;
+
+// Bytes from the first plane to the end of the last one. Planes are
+// expected to follow data[0] in the same allocation.
+uint64_t trace_get_frame_size(uint8_t *const data[], const uint32_t linesize[], const uint32_t plane_height[]);
+
+trace_t *trace_create(const char *path, const trace_header_t *info, const char *settings, const char *json,
+		      GError **error);
+trace_t *trace_open(const char *path, GError **error);
+void trace_close(trace_t *trace);
+
+// Returns false and skips the frame if its planes don't fit the slot
+bool trace_write(trace_t *trace, int64_t pts, int64_t capture_time, uint8_t *const data[], const uint32_t linesize[]);
+
+// Frames in capture order, 0 is the oldest one still in the ring. NULL
+// for torn slots and frames whose planes don't fit the slot.
+uint64_t trace_get_frame_count(trace_t *trace);
+const trace_frame_t *trace_get_frame(trace_t *trace, uint64_t index, const uint8_t **data);
+
+const char *trace_get_settings(trace_t *trace);
+const char *trace_get_json(trace_t *trace);
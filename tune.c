@@ -0,0 +1,526 @@
+/*
+ * obs-vaapi. OBS Studio plugin.
+ * Copyright (C) 2022-2023 Florian Zwoch <fzwoch@gmail.com>
+ *
+ * This file is part of obs-vaapi.
+ *
+ * obs-vaapi is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * obs-vaapi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with obs-vaapi. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Sweeps encoder properties over synthetic or traced content, measures
+// throughput, latency, bitrate and luma PSNR for each combination and
+// writes the Pareto-optimal ones as presets for the plugin.
+
+#include <gst/app/app.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "measure.h"
+#include "pareto.h"
+#include "pipeline.h"
+#include "trace.h"
+
+// Properties worth tuning, values are filtered by what the encoder
+// accepts. NULL values mean all values of an enum.
+static const struct {
+	const char *name;
+	const char *values;
+} axes[] = {
+	// va
+	{"rate-control", NULL},
+	{"target-usage", "1,4,7"},
+	{"b-frames", "0,2"},
+	{"ref-frames", "1,3"},
+	// vaapi (legacy)
+	{"quality-level", "1,4,7"},
+	{"max-bframes", "0,2"},
+	{"refs", "1,3"},
+	// Software stand-ins
+	{"speed-preset", "ultrafast,veryfast,medium"},
+	{"bframes", "0,2"},
+	{"ref", "1,3"},
+};
+
+typedef struct {
+	const char *name;
+	gchar **values;
+} axis_t;
+
+typedef struct {
+	const gchar *values[G_N_ELEMENTS(axes)];
+} combination_t;
+
+typedef struct {
+	const gchar *encoder;
+	const gchar *codec;
+	GstCaps *caps;
+	GstVideoInfo info;
+	GPtrArray *frames;
+	GArray *axes;
+} tune_t;
+
+typedef struct {
+	GMutex mutex;
+	gint64 *push_time;
+	guint count;
+	gint64 latency_sum;
+	guint latency_count;
+	guint64 bytes;
+	GPtrArray *packets;
+	GstCaps *caps;
+	GstVideoInfo *info;
+} run_t;
+
+static gchar *encoder_name = NULL;
+static gchar *trace_path = NULL;
+static gchar *pattern = "ball";
+static gint width = 1280;
+static gint height = 720;
+static gint num_frames = 120;
+static gint max_points = 48;
+static gchar *output = NULL;
+static gchar *obs_config = NULL;
+
+static GOptionEntry entries[] = {
+	{"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name, "Encoder element to tune, e.g. vah264enc or x264enc",
+	 "NAME"},
+	{"trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path, "Use the frames of a trace instead of synthetic ones",
+	 "FILE"},
+	{"pattern", 'p', 0, G_OPTION_ARG_STRING, &pattern,
+	 "videotestsrc patterns for synthetic frames, comma separated (ball)", "PATTERN"},
+	{"width", 0, 0, G_OPTION_ARG_INT, &width, "Width of synthetic frames (1280)", "W"},
+	{"height", 0, 0, G_OPTION_ARG_INT, &height, "Height of synthetic frames (720)", "H"},
+	{"frames", 'n', 0, G_OPTION_ARG_INT, &num_frames, "Number of synthetic frames per pattern (120)", "N"},
+	{"max-points", 'm', 0, G_OPTION_ARG_INT, &max_points, "Maximum number of combinations to run (48)", "N"},
+	{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+	 "Preset file (default: obs-vaapi plugin config of native and Flatpak OBS)", "FILE"},
+	{"obs-config", 'c', 0, G_OPTION_ARG_FILENAME, &obs_config,
+	 "OBS config directory, e.g. config/obs-studio of a portable install", "DIR"},
+	{NULL},
+};
+
+// Where obs_module_config_path() of the plugin points to. Native installs
+// and the Flatpak have their own config directories, write to both.
+static GPtrArray *get_preset_paths(void)
+{
+	GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+
+	if (output) {
+		g_ptr_array_add(paths, g_strdup(output));
+		return paths;
+	}
+
+	GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+
+	if (obs_config) {
+		g_ptr_array_add(dirs, g_strdup(obs_config));
+	} else {
+		g_ptr_array_add(dirs, g_build_filename(g_get_user_config_dir(), "obs-studio", NULL));
+
+		gchar *flatpak = g_build_filename(g_get_home_dir(), ".var", "app", "com.obsproject.Studio", "config",
+						  "obs-studio", NULL);
+		if (g_file_test(flatpak, G_FILE_TEST_IS_DIR)) {
+			g_ptr_array_add(dirs, flatpak);
+		} else {
+			g_free(flatpak);
+		}
+	}
+
+	gchar *filename = g_strdup_printf("%s.ini", encoder_name);
+	for (guint i = 0; i < dirs->len; i++) {
+		g_ptr_array_add(paths, g_build_filename(g_ptr_array_index(dirs, i), "plugin_config", "obs-vaapi",
+							"presets", filename, NULL));
+	}
+	g_free(filename);
+	g_ptr_array_free(dirs, TRUE);
+
+	return paths;
+}
+
+static bool load_trace_frames(tune_t *tune, trace_t *trace)
+{
+	tune->caps = pipeline_get_trace_caps(trace->header);
+
+	for (guint64 i = 0; i < trace_get_frame_count(trace); i++) {
+		const trace_frame_t *frame;
+		GstBuffer *buffer = pipeline_wrap_trace_frame(trace, i, NULL, NULL, &frame);
+
+		if (buffer != NULL) {
+			g_ptr_array_add(tune->frames, buffer);
+		}
+	}
+
+	return tune->frames->len > 0;
+}
+
+static bool value_supported(GParamSpec *param, const gchar *value)
+{
+	if (G_IS_PARAM_SPEC_ENUM(param)) {
+		return g_enum_get_value_by_nick(G_PARAM_SPEC_ENUM(param)->enum_class, value) != NULL;
+	} else if (G_IS_PARAM_SPEC_UINT(param)) {
+		guint64 v = g_ascii_strtoull(value, NULL, 10);
+		return v >= G_PARAM_SPEC_UINT(param)->minimum && v <= G_PARAM_SPEC_UINT(param)->maximum;
+	} else if (G_IS_PARAM_SPEC_INT(param)) {
+		gint64 v = g_ascii_strtoll(value, NULL, 10);
+		return v >= G_PARAM_SPEC_INT(param)->minimum && v <= G_PARAM_SPEC_INT(param)->maximum;
+	}
+
+	return false;
+}
+
+static void find_axes(tune_t *tune, GstElement *encoder)
+{
+	for (guint i = 0; i < G_N_ELEMENTS(axes); i++) {
+		GParamSpec *param = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), axes[i].name);
+		if (param == NULL || (param->flags & G_PARAM_WRITABLE) == 0) {
+			continue;
+		}
+
+		GPtrArray *values = g_ptr_array_new();
+
+		if (axes[i].values == NULL && G_IS_PARAM_SPEC_ENUM(param)) {
+			GEnumClass *enum_class = G_PARAM_SPEC_ENUM(param)->enum_class;
+			for (guint j = 0; j < enum_class->n_values; j++) {
+				g_ptr_array_add(values, g_strdup(enum_class->values[j].value_nick));
+			}
+		} else if (axes[i].values != NULL) {
+			gchar **candidates = g_strsplit(axes[i].values, ",", -1);
+			for (gchar **value = candidates; *value; value++) {
+				if (value_supported(param, *value)) {
+					g_ptr_array_add(values, g_strdup(*value));
+				}
+			}
+			g_strfreev(candidates);
+		}
+
+		if (values->len == 0) {
+			g_ptr_array_free(values, TRUE);
+			continue;
+		}
+
+		g_ptr_array_add(values, NULL);
+
+		axis_t axis = {axes[i].name, (gchar **)g_ptr_array_free(values, FALSE)};
+		g_array_append_val(tune->axes, axis);
+	}
+}
+
+static GstFlowReturn new_sample(GstAppSink *appsink, gpointer user_data)
+{
+	run_t *run = user_data;
+	GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+	if (sample == NULL) {
+		return GST_FLOW_ERROR;
+	}
+
+	gint64 now = g_get_monotonic_time();
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+
+	g_mutex_lock(&run->mutex);
+
+	if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+		guint64 index = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), GST_VIDEO_INFO_FPS_N(run->info),
+							    GST_SECOND * GST_VIDEO_INFO_FPS_D(run->info));
+		if (index < run->count && run->push_time[index] != 0) {
+			run->latency_sum += now - run->push_time[index];
+			run->latency_count++;
+		}
+	}
+
+	run->bytes += gst_buffer_get_size(buffer);
+	g_ptr_array_add(run->packets, gst_buffer_ref(buffer));
+
+	if (run->caps == NULL) {
+		run->caps = gst_caps_ref(gst_sample_get_caps(sample));
+	}
+
+	g_mutex_unlock(&run->mutex);
+
+	gst_sample_unref(sample);
+
+	return GST_FLOW_OK;
+}
+
+static void run_point(tune_t *tune, const combination_t *combination, pareto_point_t *point)
+{
+	GstElement *pipe = gst_pipeline_new(NULL);
+	GstElement *appsrc = gst_element_factory_make("appsrc", NULL);
+	GstElement *encoder = gst_element_factory_make(tune->encoder, NULL);
+	GstElement *appsink = gst_element_factory_make("appsink", NULL);
+
+	for (guint i = 0; i < tune->axes->len; i++) {
+		gst_util_set_object_arg(G_OBJECT(encoder), g_array_index(tune->axes, axis_t, i).name,
+					combination->values[i]);
+	}
+
+	g_object_set(appsrc, "caps", tune->caps, NULL);
+	gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+	GstCaps *caps = pipeline_get_packet_caps(tune->codec);
+	g_object_set(appsink, "caps", caps, "sync", FALSE, NULL);
+	gst_caps_unref(caps);
+
+	run_t run = {0};
+	g_mutex_init(&run.mutex);
+	run.count = tune->frames->len;
+	run.push_time = g_new0(gint64, run.count);
+	run.packets = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+	run.info = &tune->info;
+
+	GstAppSinkCallbacks callbacks = {.new_sample = new_sample};
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, &run, NULL);
+
+	// The same pipeline the plugin would build, with the default postproc options
+	pipeline_builder_t builder = {0};
+	gchar *graph = NULL;
+	GError *err = NULL;
+
+	pipeline_builder_add(&builder, appsrc, "frames");
+	pipeline_builder_add_encoder(&builder, tune->caps, encoder, tune->codec, "auto", "hq");
+	pipeline_builder_add(&builder, appsink, "packets");
+
+	if (!pipeline_builder_build(&builder, GST_BIN(pipe), &graph, &err)) {
+		g_printerr("  %s: %s\n", err->message, graph);
+		g_error_free(err);
+	}
+	g_free(graph);
+
+	GstBus *bus = gst_element_get_bus(pipe);
+	guint64 max_bytes = GST_VIDEO_INFO_SIZE(&tune->info) * 2;
+
+	gst_element_set_state(pipe, GST_STATE_PLAYING);
+
+	gint64 start = g_get_monotonic_time();
+	bool error = false;
+
+	// Like the plugin keep at most two frames queued. Not using a blocking
+	// appsrc so that an encoder error cannot stall the push.
+	for (guint i = 0; i < tune->frames->len && !error; i++) {
+		while (gst_app_src_get_current_level_bytes(GST_APP_SRC(appsrc)) >= max_bytes && !error) {
+			error = measure_pop_error(bus, 500 * GST_USECOND, 0);
+		}
+
+		GstBuffer *buffer = gst_buffer_copy(g_ptr_array_index(tune->frames, i));
+
+		GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND * GST_VIDEO_INFO_FPS_D(&tune->info),
+							       GST_VIDEO_INFO_FPS_N(&tune->info));
+		GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+
+		g_mutex_lock(&run.mutex);
+		run.push_time[i] = g_get_monotonic_time();
+		g_mutex_unlock(&run.mutex);
+
+		gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer);
+	}
+	gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+	if (!error) {
+		error = measure_pop_error(bus, 60 * GST_SECOND, GST_MESSAGE_EOS);
+	}
+	gst_object_unref(bus);
+
+	point->failed = error || run.packets->len == 0;
+
+	gdouble wall = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(pipe);
+
+	if (!point->failed) {
+		gdouble duration = (gdouble)tune->frames->len * GST_VIDEO_INFO_FPS_D(&tune->info) /
+				   GST_VIDEO_INFO_FPS_N(&tune->info);
+
+		point->fps = tune->frames->len / wall;
+		point->latency = run.latency_count ? run.latency_sum / 1000.0 / run.latency_count : 0.0;
+		point->bitrate = run.bytes * 8 / duration / 1000.0;
+		point->psnr = measure_psnr(tune->frames, &tune->info, run.packets, run.caps);
+	}
+
+	g_ptr_array_free(run.packets, TRUE);
+	g_free(run.push_time);
+	if (run.caps) {
+		gst_caps_unref(run.caps);
+	}
+	g_mutex_clear(&run.mutex);
+}
+
+static bool write_presets(tune_t *tune, const combination_t *combinations, const pareto_point_t *points, guint count,
+			  const gchar *path, GError **error)
+{
+	GKeyFile *key_file = g_key_file_new();
+
+	for (guint i = 0; i < count; i++) {
+		if (!points[i].pareto) {
+			continue;
+		}
+
+		gchar *group = pareto_get_name(points, count, i);
+
+		for (guint j = 0; j < tune->axes->len; j++) {
+			g_key_file_set_string(key_file, group, g_array_index(tune->axes, axis_t, j).name,
+					      combinations[i].values[j]);
+		}
+
+		gchar *comment = g_strdup_printf(" %.1f fps, %.2f ms latency, %.0f kbit/s, %.2f dB PSNR",
+						 points[i].fps, points[i].latency, points[i].bitrate, points[i].psnr);
+		g_key_file_set_comment(key_file, group, NULL, comment, NULL);
+		g_free(comment);
+
+		g_free(group);
+	}
+
+	gchar *dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+
+	bool ok = g_key_file_save_to_file(key_file, path, error);
+	g_key_file_free(key_file);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context = g_option_context_new("- tune obs-vaapi encoder settings");
+	GError *err = NULL;
+
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gst_init_get_option_group());
+
+	if (!g_option_context_parse(context, &argc, &argv, &err) || encoder_name == NULL) {
+		g_printerr("%s\n", err ? err->message : "missing --encoder");
+		g_printerr("%s", g_option_context_get_help(context, TRUE, NULL));
+		return 1;
+	}
+	g_option_context_free(context);
+
+	GstElement *encoder = gst_element_factory_make(encoder_name, NULL);
+	if (encoder == NULL) {
+		g_printerr("no such element: %s\n", encoder_name);
+		return 1;
+	}
+
+	GstElement *parser = pipeline_make_parser(pipeline_get_codec(encoder_name));
+	if (parser == NULL) {
+		g_printerr("no parser for %s\n", pipeline_get_codec(encoder_name));
+		return 1;
+	}
+	gst_object_unref(parser);
+
+	tune_t tune = {0};
+	tune.encoder = encoder_name;
+	tune.codec = pipeline_get_codec(encoder_name);
+	tune.frames = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+	tune.axes = g_array_new(FALSE, FALSE, sizeof(axis_t));
+
+	find_axes(&tune, encoder);
+	gst_object_unref(encoder);
+
+	trace_t *trace = NULL;
+
+	if (trace_path) {
+		trace = trace_open(trace_path, &err);
+		if (trace == NULL) {
+			g_printerr("%s\n", err->message);
+			g_error_free(err);
+			return 1;
+		}
+	}
+
+	if (!(trace ? load_trace_frames(&tune, trace)
+		    : measure_load_synthetic(pattern, width, height, num_frames, tune.frames, &tune.caps))) {
+		g_printerr("no frames to encode\n");
+		return 1;
+	}
+
+	gst_video_info_from_caps(&tune.info, tune.caps);
+
+	// Cartesian product of all axes, evenly thinned out to max-points
+	guint total = 1;
+	for (guint i = 0; i < tune.axes->len; i++) {
+		total *= g_strv_length(g_array_index(tune.axes, axis_t, i).values);
+	}
+
+	guint count = MIN(total, (guint)MAX(max_points, 1));
+	combination_t *combinations = g_new0(combination_t, count);
+	pareto_point_t *points = g_new0(pareto_point_t, count);
+
+	g_print("%s: %u combinations, running %u on %u frames\n", encoder_name, total, count, tune.frames->len);
+
+	for (guint n = 0; n < count; n++) {
+		guint combination = (guint)((guint64)n * total / count);
+
+		for (guint i = 0; i < tune.axes->len; i++) {
+			gchar **values = g_array_index(tune.axes, axis_t, i).values;
+			guint len = g_strv_length(values);
+
+			combinations[n].values[i] = values[combination % len];
+			combination /= len;
+		}
+
+		GString *settings = g_string_new(NULL);
+		for (guint i = 0; i < tune.axes->len; i++) {
+			g_string_append_printf(settings, "%s=%s ", g_array_index(tune.axes, axis_t, i).name,
+					       combinations[n].values[i]);
+		}
+		g_print("[%u/%u] %s\n", n + 1, count, settings->str);
+		g_string_free(settings, TRUE);
+
+		run_point(&tune, &combinations[n], &points[n]);
+
+		if (points[n].failed) {
+			g_print("  failed\n");
+		} else {
+			g_print("  %.1f fps, %.2f ms, %.0f kbit/s, %.2f dB\n", points[n].fps, points[n].latency,
+				points[n].bitrate, points[n].psnr);
+		}
+	}
+
+	pareto_find(points, count);
+
+	GPtrArray *paths = get_preset_paths();
+	int ret = 0;
+
+	for (guint i = 0; i < paths->len; i++) {
+		const gchar *path = g_ptr_array_index(paths, i);
+
+		if (write_presets(&tune, combinations, points, count, path, &err)) {
+			g_print("presets written to %s\n", path);
+		} else {
+			g_printerr("%s\n", err->message);
+			g_clear_error(&err);
+			ret = 1;
+		}
+	}
+
+	g_ptr_array_free(paths, TRUE);
+	g_free(points);
+	g_free(combinations);
+
+	for (guint i = 0; i < tune.axes->len; i++) {
+		g_strfreev(g_array_index(tune.axes, axis_t, i).values);
+	}
+	g_array_free(tune.axes, TRUE);
+	g_ptr_array_free(tune.frames, TRUE);
+	gst_caps_unref(tune.caps);
+
+	if (trace) {
+		trace_close(trace);
+	}
+
+	return ret;
+}